@@ -0,0 +1,53 @@
+#include "analog.h"
+
+#define D DS5_ANALOG_DEADZONE
+
+const struct ds5_analog ds5_analog_default = {
+	.axis = {
+		{ D, D, 0, 0 }, { D, D, 0, 0 }, { D, D, 0, 0 },
+		{ D, D, 0, 0 }, { D, D, 0, 0 }, { D, D, 0, 0 },
+	},
+};
+
+/* Output distance from rest for a raw distance a, out of full */
+static unsigned int response(const struct ds5_axis_curve *curve, unsigned int a,
+			     unsigned int full)
+{
+	unsigned int deadzone = curve->deadzone < full ? curve->deadzone : full - 1;
+	unsigned int anti = curve->anti_deadzone < full ? curve->anti_deadzone : full;
+	int span = (int)full - curve->outer - deadzone;
+	long long t, t3;
+
+	if (a <= deadzone)
+		return 0;
+
+	if (span < 1)
+		span = 1;
+
+	/* Position past the deadzone, Q16 */
+	t = ((long long)(a - deadzone) << 16) / span;
+	if (t > 0x10000)
+		t = 0x10000;
+
+	t3 = (((t * t) >> 16) * t) >> 16;
+	t += (t3 - t) * curve->curve / 100;
+
+	return anti + ((t * (full - anti) + 0x8000) >> 16);
+}
+
+void ds5_analog_build_lut(const struct ds5_axis_curve *curve, int centered, int invert,
+			  unsigned char lut[256])
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++) {
+		unsigned int v = invert ? 255 - i : i;
+
+		if (!centered)
+			lut[i] = response(curve, v, 255);
+		else if (v >= 128)
+			lut[i] = 128 + response(curve, v - 128, 127);
+		else
+			lut[i] = 128 - response(curve, 128 - v, 128);
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef ANALOG_H
+#define ANALOG_H
+
+/* Axial deadzone of the default response, the old fixed threshold */
+#define DS5_ANALOG_DEADZONE 3
+
+/* Response of one axis, in raw units measured from rest */
+struct ds5_axis_curve {
+	unsigned char deadzone;      /* axial, reads as rest up to this far */
+	unsigned char anti_deadzone; /* output jumps this far when leaving the deadzone */
+	unsigned char outer;         /* this close to the end already reads as full */
+	unsigned char curve;         /* 0 linear to 100 cubic */
+};
+
+struct ds5_analog {
+	struct ds5_axis_curve axis[6]; /* indexed by enum ds5_axis */
+	unsigned char radial[2];       /* left and right stick radial deadzones */
+};
+
+/* Same response as the fixed threshold: a 3 unit deadzone, linear */
+extern const struct ds5_analog ds5_analog_default;
+
+/*
+ * Bakes an axis response into a table indexed by the raw value. Sticks
+ * rest at 128, triggers at 0; invert mirrors the input first.
+ */
+void ds5_analog_build_lut(const struct ds5_axis_curve *curve, int centered, int invert,
+			  unsigned char lut[256]);
+
+#endif
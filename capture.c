@@ -0,0 +1,218 @@
+#include <string.h>
+#include <psp2kern/kernel/threadmgr.h>
+#include <psp2kern/io/fcntl.h>
+#include "capture.h"
+
+extern int ksceIoMkdir(const char *, int);
+
+#define CAPTURE_EVF_FLUSH 1
+#define CAPTURE_EVF_STOP  2
+
+/*
+ * Single producer (the BT thread), single consumer (the writer thread).
+ * The ring holds the records exactly as they go to the file.
+ */
+static unsigned char ring[DS5_CAPTURE_RING_SIZE];
+static volatile unsigned int ring_head;
+static volatile unsigned int ring_tail;
+
+static int capture_enabled = 0;
+static unsigned int capture_dropped = 0;
+static unsigned long long capture_last;
+
+static SceUID capture_fd = -1;
+static SceUID capture_evf_uid = -1;
+static SceUID capture_thread_uid = -1;
+static volatile int capture_thread_run = 1;
+
+static void ring_copy(unsigned int pos, const void *data, unsigned int length)
+{
+	unsigned int offset = pos & (DS5_CAPTURE_RING_SIZE - 1);
+	unsigned int first = DS5_CAPTURE_RING_SIZE - offset;
+
+	if (first > length)
+		first = length;
+
+	memcpy(&ring[offset], data, first);
+	memcpy(&ring[0], (const unsigned char *)data + first, length - first);
+}
+
+static void capture_record(unsigned char type, const void *payload, unsigned int length,
+			   unsigned long long timestamp)
+{
+	struct ds5_trace_record rec;
+	unsigned int head = ring_head;
+	unsigned int needed = 2 * sizeof(rec) + length + sizeof(capture_dropped);
+
+	if (!capture_enabled)
+		return;
+
+	if (DS5_CAPTURE_RING_SIZE - (head - ring_tail) < needed) {
+		capture_dropped++;
+		return;
+	}
+
+	rec.delta = timestamp - capture_last > 0xFFFFFFFF ?
+		0xFFFFFFFF : timestamp - capture_last;
+	rec.reserved = 0;
+	capture_last = timestamp;
+
+	if (capture_dropped) {
+		rec.type = DS5_TRACE_DROPPED;
+		rec.length = sizeof(capture_dropped);
+		ring_copy(head, &rec, sizeof(rec));
+		ring_copy(head + sizeof(rec), &capture_dropped, sizeof(capture_dropped));
+		head += sizeof(rec) + sizeof(capture_dropped);
+		rec.delta = 0;
+		capture_dropped = 0;
+	}
+
+	rec.type = type;
+	rec.length = length;
+	ring_copy(head, &rec, sizeof(rec));
+	ring_copy(head + sizeof(rec), payload, length);
+	head += sizeof(rec) + length;
+
+	__sync_synchronize();
+	ring_head = head;
+
+	if (head - ring_tail >= DS5_CAPTURE_RING_SIZE / 2)
+		ksceKernelSetEventFlag(capture_evf_uid, CAPTURE_EVF_FLUSH);
+}
+
+void ds5_capture_event(const SceBtEvent *event, unsigned long long timestamp)
+{
+	capture_record(DS5_TRACE_EVENT, event, sizeof(*event), timestamp);
+}
+
+void ds5_capture_report(const void *report, unsigned int length,
+			unsigned long long timestamp)
+{
+	capture_record(DS5_TRACE_REPORT, report, length, timestamp);
+}
+
+void ds5_capture_vid_pid(unsigned int mac0, unsigned int mac1,
+			 const unsigned short vid_pid[2], unsigned long long timestamp)
+{
+	unsigned int payload[3] = { mac0, mac1, vid_pid[0] | (vid_pid[1] << 16) };
+
+	capture_record(DS5_TRACE_VID_PID, payload, sizeof(payload), timestamp);
+}
+
+/* Writes out what the BT thread produced so far, in at most two chunks */
+static void capture_drain(void)
+{
+	unsigned int head = ring_head;
+	unsigned int tail = ring_tail;
+
+	__sync_synchronize();
+
+	while (tail != head) {
+		unsigned int offset = tail & (DS5_CAPTURE_RING_SIZE - 1);
+		unsigned int length = head - tail;
+
+		if (length > DS5_CAPTURE_RING_SIZE - offset)
+			length = DS5_CAPTURE_RING_SIZE - offset;
+
+		ksceIoWrite(capture_fd, &ring[offset], length);
+		tail += length;
+	}
+
+	__sync_synchronize();
+	ring_tail = tail;
+}
+
+static int capture_thread(SceSize args, void *argp)
+{
+	unsigned int bits;
+	SceUInt timeout;
+
+	while (capture_thread_run) {
+		timeout = DS5_CAPTURE_FLUSH_INTERVAL;
+		ksceKernelWaitEventFlag(capture_evf_uid, CAPTURE_EVF_FLUSH | CAPTURE_EVF_STOP,
+			SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT, &bits, &timeout);
+
+		capture_drain();
+	}
+
+	return 0;
+}
+
+int ds5_capture_start(void)
+{
+	struct ds5_trace_header header;
+	SceUID fd;
+
+	fd = ksceIoOpen(DS5_CAPTURE_FLAG, SCE_O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	ksceIoClose(fd);
+
+	ksceIoMkdir(DS5_CAPTURE_PATH, 6);
+	capture_fd = ksceIoOpen(DS5_CAPTURE_FILE,
+		SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 6);
+	if (capture_fd < 0)
+		return capture_fd;
+
+	capture_last = ksceKernelGetSystemTimeWide();
+
+	header.magic = DS5_TRACE_MAGIC;
+	header.version = DS5_TRACE_VERSION;
+	header.size = sizeof(header);
+	header.start = capture_last;
+	ksceIoWrite(capture_fd, &header, sizeof(header));
+
+	capture_evf_uid = ksceKernelCreateEventFlag("ds5vita_capture_evf", 0, 0, NULL);
+	if (capture_evf_uid < 0)
+		goto error_close;
+
+	capture_thread_run = 1;
+	capture_thread_uid = ksceKernelCreateThread("ds5vita_capture_thread",
+		capture_thread, 0xA0, 0x1000, 0, 0x10000, 0);
+	if (capture_thread_uid < 0)
+		goto error_evf;
+
+	ksceKernelStartThread(capture_thread_uid, 0, NULL);
+
+	capture_enabled = 1;
+	return 1;
+
+error_evf:
+	ksceKernelDeleteEventFlag(capture_evf_uid);
+	capture_evf_uid = -1;
+error_close:
+	ksceIoClose(capture_fd);
+	capture_fd = -1;
+	return -1;
+}
+
+/*
+ * Returns < 0 if the writer thread did not exit in time. It is then left
+ * running with its event flag and file, and the module must not be unloaded.
+ */
+int ds5_capture_stop(void)
+{
+	SceUInt timeout = DS5_CAPTURE_FLUSH_INTERVAL;
+
+	if (capture_thread_uid < 0)
+		return 0;
+
+	capture_enabled = 0;
+
+	capture_thread_run = 0;
+	ksceKernelSetEventFlag(capture_evf_uid, CAPTURE_EVF_STOP);
+	if (ksceKernelWaitThreadEnd(capture_thread_uid, NULL, &timeout) < 0)
+		return -1;
+	ksceKernelDeleteThread(capture_thread_uid);
+	capture_thread_uid = -1;
+
+	capture_drain();
+
+	ksceKernelDeleteEventFlag(capture_evf_uid);
+	capture_evf_uid = -1;
+
+	ksceIoClose(capture_fd);
+	capture_fd = -1;
+
+	return 0;
+}
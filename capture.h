@@ -0,0 +1,55 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <psp2kern/bt.h>
+
+/*
+ * Capture of the raw Bluetooth traffic, for replaying bug reports and
+ * benchmarks through the host build. Enabled by creating DS5_CAPTURE_FLAG
+ * before the plugin loads; the trace goes to DS5_CAPTURE_FILE.
+ */
+#define DS5_CAPTURE_PATH "ux0:data/ds5vita/"
+#define DS5_CAPTURE_FLAG DS5_CAPTURE_PATH "capture"
+#define DS5_CAPTURE_FILE DS5_CAPTURE_PATH "capture.bin"
+
+/* Staging ring between the BT callback and the writer thread */
+#define DS5_CAPTURE_RING_SIZE (32 * 1024)
+#define DS5_CAPTURE_FLUSH_INTERVAL (500 * 1000)
+
+/*
+ * Trace format, little endian: one ds5_trace_header, then records
+ * until the end of the file, each a ds5_trace_record and its payload.
+ */
+#define DS5_TRACE_MAGIC   0x54355344 /* "DS5T" */
+#define DS5_TRACE_VERSION 1
+
+#define DS5_TRACE_EVENT   1 /* SceBtEvent */
+#define DS5_TRACE_REPORT  2 /* input report read for the preceding 0x0A event */
+#define DS5_TRACE_VID_PID 3 /* mac0, mac1, vid | pid << 16 */
+#define DS5_TRACE_DROPPED 4 /* number of records lost to a full ring */
+
+struct ds5_trace_header {
+	unsigned int magic;
+	unsigned short version;
+	unsigned short size;
+	unsigned long long start; /* system time of the first delta, us */
+} __attribute__((packed));
+
+struct ds5_trace_record {
+	unsigned int delta;       /* us since the previous record */
+	unsigned char type;
+	unsigned char reserved;
+	unsigned short length;    /* of the payload */
+} __attribute__((packed));
+
+int ds5_capture_start(void);
+int ds5_capture_stop(void);
+
+/* Only called from the BT thread */
+void ds5_capture_event(const SceBtEvent *event, unsigned long long timestamp);
+void ds5_capture_report(const void *report, unsigned int length,
+			unsigned long long timestamp);
+void ds5_capture_vid_pid(unsigned int mac0, unsigned int mac1,
+			 const unsigned short vid_pid[2], unsigned long long timestamp);
+
+#endif
@@ -0,0 +1,377 @@
+#include <string.h>
+#include <psp2kern/ctrl.h>
+#include <psp2kern/io/fcntl.h>
+#include "log.h"
+#include "config.h"
+#include "predict.h"
+#include "output.h"
+
+struct name {
+	const char *name;
+	unsigned int value;
+};
+
+static const struct name ds5_buttons[] = {
+	{ "square",   DS5_BTN_SQUARE },
+	{ "cross",    DS5_BTN_CROSS },
+	{ "circle",   DS5_BTN_CIRCLE },
+	{ "triangle", DS5_BTN_TRIANGLE },
+	{ "l1",       DS5_BTN_L1 },
+	{ "r1",       DS5_BTN_R1 },
+	{ "l2",       DS5_BTN_L2 },
+	{ "r2",       DS5_BTN_R2 },
+	{ "share",    DS5_BTN_SHARE },
+	{ "options",  DS5_BTN_OPTIONS },
+	{ "l3",       DS5_BTN_L3 },
+	{ "r3",       DS5_BTN_R3 },
+	{ "ps",       DS5_BTN_PS },
+	{ "tpad",     DS5_BTN_TPAD },
+	{ "up",       DS5_BTN_UP },
+	{ "right",    DS5_BTN_RIGHT },
+	{ "down",     DS5_BTN_DOWN },
+	{ "left",     DS5_BTN_LEFT },
+	{ NULL, 0 }
+};
+
+static const struct name vita_buttons[] = {
+	{ "none",        0 },
+	{ "select",      SCE_CTRL_SELECT },
+	{ "start",       SCE_CTRL_START },
+	{ "l3",          SCE_CTRL_L3 },
+	{ "r3",          SCE_CTRL_R3 },
+	{ "up",          SCE_CTRL_UP },
+	{ "right",       SCE_CTRL_RIGHT },
+	{ "down",        SCE_CTRL_DOWN },
+	{ "left",        SCE_CTRL_LEFT },
+	{ "l2",          SCE_CTRL_LTRIGGER },
+	{ "r2",          SCE_CTRL_RTRIGGER },
+	{ "l1",          SCE_CTRL_L1 },
+	{ "r1",          SCE_CTRL_R1 },
+	{ "triangle",    SCE_CTRL_TRIANGLE },
+	{ "circle",      SCE_CTRL_CIRCLE },
+	{ "cross",       SCE_CTRL_CROSS },
+	{ "square",      SCE_CTRL_SQUARE },
+	{ "ps",          SCE_CTRL_INTERCEPTED },
+	{ NULL, 0 }
+};
+
+static const struct name axes[] = {
+	{ "lx", DS5_AXIS_LX },
+	{ "ly", DS5_AXIS_LY },
+	{ "rx", DS5_AXIS_RX },
+	{ "ry", DS5_AXIS_RY },
+	{ "lt", DS5_AXIS_LT },
+	{ "rt", DS5_AXIS_RT },
+	{ NULL, 0 }
+};
+
+/* Axis groups of the response settings, as DS5_AXIS_* ranges */
+static const struct name groups[] = {
+	{ "left",  DS5_AXIS_LX },
+	{ "right", DS5_AXIS_RX },
+	{ "lt",    DS5_AXIS_LT },
+	{ "rt",    DS5_AXIS_RT },
+	{ NULL, 0 }
+};
+
+static const struct name touch_ports[] = {
+	{ "front", SCE_TOUCH_PORT_FRONT },
+	{ "back",  SCE_TOUCH_PORT_BACK },
+	{ NULL, 0 }
+};
+
+static char config_buf[DS5_CONFIG_MAX_SIZE + 1];
+
+static int is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Next word of [*p, end), lower cased in place, or NULL at the end */
+static char *next_word(char **p, char *end)
+{
+	char *word;
+
+	while (*p < end && (is_space(**p) || **p == '|'))
+		(*p)++;
+	if (*p == end)
+		return NULL;
+
+	word = *p;
+	while (*p < end && !is_space(**p) && **p != '|') {
+		if (**p >= 'A' && **p <= 'Z')
+			**p += 'a' - 'A';
+		(*p)++;
+	}
+	if (*p < end)
+		*(*p)++ = '\0';
+
+	return word;
+}
+
+static int lookup(const struct name *names, const char *word, unsigned int *value)
+{
+	for (; names->name; names++) {
+		if (strcmp(names->name, word) == 0) {
+			*value = names->value;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int parse_uint(const char *word, unsigned int *value)
+{
+	unsigned int v = 0;
+
+	if (!*word)
+		return -1;
+
+	for (; *word; word++) {
+		if (*word < '0' || *word > '9' || v > 0xFFFF)
+			return -1;
+		v = v * 10 + (*word - '0');
+	}
+
+	*value = v;
+	return 0;
+}
+
+static int parse_number(char **p, char *end, unsigned int *value)
+{
+	char *word = next_word(p, end);
+
+	return word ? parse_uint(word, value) : -1;
+}
+
+/* deadzone_, anti_deadzone_, outer_ and curve_ followed by a group, or radial_left/right */
+static int parse_response(struct ds5_analog *analog, const char *key, char **p, char *end)
+{
+	static const char *params[] = { "deadzone_", "anti_deadzone_", "outer_", "curve_", "radial_" };
+	unsigned int param, axis, count, value, i;
+
+	for (param = 0; param < 5; param++) {
+		if (strncmp(key, params[param], strlen(params[param])) == 0)
+			break;
+	}
+	if (param == 5 || lookup(groups, key + strlen(params[param]), &axis) < 0)
+		return -1;
+
+	if (parse_number(p, end, &value) < 0 || value > (param == 3 ? 100 : 255))
+		return -1;
+
+	if (param == 4) {
+		if (axis >= DS5_AXIS_LT)
+			return -1;
+		analog->radial[axis / 2] = value;
+		return 0;
+	}
+
+	count = axis < DS5_AXIS_LT ? 2 : 1;
+	for (i = axis; i < axis + count; i++) {
+		struct ds5_axis_curve *curve = &analog->axis[i];
+
+		if (param == 0)
+			curve->deadzone = value;
+		else if (param == 1)
+			curve->anti_deadzone = value;
+		else if (param == 2)
+			curve->outer = value;
+		else
+			curve->curve = value;
+	}
+
+	return 0;
+}
+
+static int parse_zone(struct ds5_config *config, char **p, char *end, int *zones_set)
+{
+	struct ds5_touch_zone *zone;
+	unsigned int v[9];
+	unsigned int i;
+	char *word;
+
+	if (!*zones_set) {
+		config->num_zones = 0;
+		*zones_set = 1;
+	}
+	if (config->num_zones == DS5_TOUCH_MAX_ZONES)
+		return -1;
+
+	for (i = 0; i < 9; i++) {
+		word = next_word(p, end);
+		if (!word)
+			return -1;
+		if (i == 4 ? lookup(touch_ports, word, &v[i]) : parse_uint(word, &v[i]))
+			return -1;
+	}
+
+	zone = &config->zones[config->num_zones++];
+	zone->x0 = v[0];
+	zone->y0 = v[1];
+	zone->x1 = v[2];
+	zone->y1 = v[3];
+	zone->port = v[4];
+	zone->dx0 = v[5];
+	zone->dy0 = v[6];
+	zone->dx1 = v[7];
+	zone->dy1 = v[8];
+
+	return 0;
+}
+
+static int parse_line(struct ds5_config *config, char *p, char *end, int *zones_set)
+{
+	struct ds5_remap *remap = &config->remap;
+	char *eq = memchr(p, '=', end - p);
+	unsigned int index, value;
+	char *key, *word;
+
+	if (eq)
+		*eq = '\0';
+
+	key = next_word(&p, eq ? eq : end);
+	if (!key)
+		return eq ? -1 : 0;
+	if (!eq || next_word(&p, eq))
+		return -1;
+	p = eq + 1;
+
+	if (lookup(ds5_buttons, key, &index) == 0) {
+		unsigned int buttons = 0;
+
+		while ((word = next_word(&p, end))) {
+			if (lookup(vita_buttons, word, &value) < 0)
+				return -1;
+			buttons |= value;
+		}
+		remap->button[index] = buttons;
+		return 0;
+	}
+
+	if (strncmp(key, "invert_", 7) == 0) {
+		if (lookup(axes, key + 7, &index) < 0 || parse_number(&p, end, &value) < 0)
+			return -1;
+		remap->invert[index] = value != 0;
+		return 0;
+	}
+
+	if (strcmp(key, "swap_sticks") == 0) {
+		if (parse_number(&p, end, &value) < 0)
+			return -1;
+		remap->axis[DS5_AXIS_LX] = value ? DS5_AXIS_RX : DS5_AXIS_LX;
+		remap->axis[DS5_AXIS_LY] = value ? DS5_AXIS_RY : DS5_AXIS_LY;
+		remap->axis[DS5_AXIS_RX] = value ? DS5_AXIS_LX : DS5_AXIS_RX;
+		remap->axis[DS5_AXIS_RY] = value ? DS5_AXIS_LY : DS5_AXIS_RY;
+		return 0;
+	}
+
+	if (strcmp(key, "swap_triggers") == 0) {
+		if (parse_number(&p, end, &value) < 0)
+			return -1;
+		remap->axis[DS5_AXIS_LT] = value ? DS5_AXIS_RT : DS5_AXIS_LT;
+		remap->axis[DS5_AXIS_RT] = value ? DS5_AXIS_LT : DS5_AXIS_RT;
+		return 0;
+	}
+
+	if (strcmp(key, "touch") == 0) {
+		word = next_word(&p, end);
+		if (!word || *zones_set)
+			return -1;
+		if (strcmp(word, "front") == 0) {
+			memcpy(config->zones, ds5_touch_zones_front, sizeof(ds5_touch_zones_front));
+			config->num_zones = 1;
+		} else if (strcmp(word, "split") == 0) {
+			memcpy(config->zones, ds5_touch_zones_split, sizeof(ds5_touch_zones_split));
+			config->num_zones = 2;
+		} else {
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strcmp(key, "zone") == 0)
+		return parse_zone(config, &p, end, zones_set);
+
+	if (strcmp(key, "predict") == 0) {
+		if (parse_number(&p, end, &value) < 0 || value > DS5_PREDICT_MAX_AHEAD)
+			return -1;
+		config->predict = value * 1000;
+		return 0;
+	}
+
+	if (strcmp(key, "output_rate") == 0) {
+		if (parse_number(&p, end, &value) < 0 || value < 1 ||
+		    value > DS5_OUTPUT_RATE_LIMIT_HZ)
+			return -1;
+		config->output_rate = value;
+		return 0;
+	}
+
+	return parse_response(&config->analog, key, &p, end);
+}
+
+void ds5_config_defaults(struct ds5_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->remap = ds5_remap_default;
+	config->analog = ds5_analog_default;
+	memcpy(config->zones, ds5_touch_zones_front, sizeof(ds5_touch_zones_front));
+	config->num_zones = 1;
+	config->output_rate = DS5_OUTPUT_MAX_RATE_HZ;
+}
+
+/*
+ * Returns the number of lines that were ignored. The text is tokenized in
+ * place and text[length] must be writable.
+ */
+int ds5_config_parse(struct ds5_config *config, char *text, unsigned int length)
+{
+	char *p = text;
+	char *end = p + length;
+	int zones_set = 0;
+	int line = 0, errors = 0;
+
+	while (p < end) {
+		char *eol = memchr(p, '\n', end - p);
+		char *comment;
+
+		if (!eol)
+			eol = end;
+		line++;
+
+		*eol = '\0';
+		comment = memchr(p, '#', eol - p);
+		if (comment)
+			*comment = '\0';
+
+		if (parse_line(config, p, comment ? comment : eol, &zones_set) < 0) {
+			LOG("Config line %d ignored\n", line);
+			errors++;
+		}
+
+		p = eol + 1;
+	}
+
+	return errors;
+}
+
+int ds5_config_load(struct ds5_config *config, const char *path)
+{
+	SceUID fd;
+	int length;
+
+	ds5_config_defaults(config);
+
+	fd = ksceIoOpen(path, SCE_O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	length = ksceIoRead(fd, config_buf, DS5_CONFIG_MAX_SIZE);
+	ksceIoClose(fd);
+	if (length < 0)
+		return length;
+
+	return ds5_config_parse(config, config_buf, length);
+}
@@ -0,0 +1,41 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "report.h"
+#include "touch.h"
+
+/*
+ * Read once at module_start, a missing file keeps the defaults.
+ * One "key = value" per line, # starts a comment:
+ *
+ *   cross = circle            DS5 button = SceCtrl buttons, | separated, or none
+ *   swap_sticks = 1           also swap_triggers, invert_lx ly rx ry lt rt
+ *   deadzone_left = 10        also anti_deadzone_, outer_, curve_ (0-100),
+ *                             for left, right, lt and rt; radial_left/right
+ *   touch = split             front (default) or split
+ *   zone = 0 0 960 940 back 0 108 1920 890
+ *                             custom touch zone, replaces the preset
+ *   predict = 4               extrapolate sticks and triggers up to 4 ms
+ *                             to the SceCtrl call, 0 (default) is off
+ *   output_rate = 50          rumble and lightbar reports per second, at
+ *                             most (1-250, default 100)
+ */
+#define DS5_CONFIG_PATH "ux0:data/ds5vita/"
+#define DS5_CONFIG_FILE DS5_CONFIG_PATH "config.txt"
+
+#define DS5_CONFIG_MAX_SIZE 4096
+
+struct ds5_config {
+	struct ds5_remap remap;
+	struct ds5_analog analog;
+	unsigned int num_zones;
+	struct ds5_touch_zone zones[DS5_TOUCH_MAX_ZONES];
+	unsigned int predict; /* us, 0 is off */
+	unsigned int output_rate; /* Hz */
+};
+
+void ds5_config_defaults(struct ds5_config *config);
+int ds5_config_parse(struct ds5_config *config, char *text, unsigned int length);
+int ds5_config_load(struct ds5_config *config, const char *path);
+
+#endif
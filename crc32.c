@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include <string.h>
+#include "crc32.h"
+
+/* Slice-by-4, built once by crc32_init() */
+static unsigned int crc32_table[4][256];
+
+void crc32_init(void)
+{
+	unsigned int i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+		crc32_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (j = 1; j < 4; j++) {
+			c = crc32_table[j - 1][i];
+			crc32_table[j][i] = (c >> 8) ^ crc32_table[0][c & 0xFF];
+		}
+	}
+}
+
+unsigned int crc32_update(unsigned int crc, const unsigned char *data, unsigned int len)
+{
+	while (len && ((uintptr_t)data & 3)) {
+		crc = crc32_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	/* Little-endian word at a time, 4 table loads per 4 bytes */
+	while (len >= 4) {
+		unsigned int w;
+
+		memcpy(&w, data, sizeof(w));
+		crc ^= w;
+		crc = crc32_table[3][crc & 0xFF] ^
+			crc32_table[2][(crc >> 8) & 0xFF] ^
+			crc32_table[1][(crc >> 16) & 0xFF] ^
+			crc32_table[0][crc >> 24];
+		data += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		crc = crc32_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
@@ -0,0 +1,12 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+void crc32_init(void);
+
+/*
+ * Raw CRC32 (poly 0xEDB88320) update without the pre/post inversion,
+ * a standard CRC32 is ~crc32_update(0xFFFFFFFF, data, len).
+ */
+unsigned int crc32_update(unsigned int crc, const unsigned char *data, unsigned int len);
+
+#endif
@@ -0,0 +1,128 @@
+#include <string.h>
+#include <psp2kern/io/fcntl.h>
+#include "device.h"
+
+extern int ksceIoMkdir(const char *, int);
+
+struct ds5_device ds5_devices[DS5_MAX_DEVICES];
+
+/* Index + 1 into ds5_devices, 0 is an empty bucket */
+static unsigned char mac_table[DS5_DEVICE_HASH_SIZE];
+
+static unsigned int generation = 0;
+
+static inline unsigned int mac_hash(unsigned int mac0, unsigned int mac1)
+{
+	unsigned int h = (mac0 ^ (mac1 * 0x9E3779B9)) * 0x9E3779B9;
+
+	return h >> (32 - DS5_DEVICE_HASH_BITS);
+}
+
+struct ds5_device *ds5_device_find(unsigned int mac0, unsigned int mac1)
+{
+	unsigned int i, b = mac_hash(mac0, mac1);
+
+	for (i = 0; i < DS5_DEVICE_HASH_SIZE; i++, b = (b + 1) & (DS5_DEVICE_HASH_SIZE - 1)) {
+		struct ds5_device *device;
+
+		if (!mac_table[b])
+			return NULL;
+
+		device = &ds5_devices[mac_table[b] - 1];
+		if (device->mac0 == mac0 && device->mac1 == mac1)
+			return device;
+	}
+
+	return NULL;
+}
+
+static void mac_table_insert(unsigned int index)
+{
+	const struct ds5_device *device = &ds5_devices[index];
+	unsigned int b = mac_hash(device->mac0, device->mac1);
+
+	while (mac_table[b])
+		b = (b + 1) & (DS5_DEVICE_HASH_SIZE - 1);
+
+	mac_table[b] = index + 1;
+}
+
+/*
+ * Takes the lowest free port. The slot is returned cleared but not yet
+ * connected, the caller sets that once it is ready for the hooks.
+ */
+struct ds5_device *ds5_device_add(unsigned int mac0, unsigned int mac1)
+{
+	unsigned int i;
+
+	for (i = 0; i < DS5_MAX_DEVICES; i++) {
+		struct ds5_device *device = &ds5_devices[i];
+
+		if (device->port)
+			continue;
+
+		memset(device, 0, sizeof(*device));
+		device->port = i + 1;
+		device->generation = ++generation;
+		device->mac0 = mac0;
+		device->mac1 = mac1;
+
+		mac_table_insert(i);
+		return device;
+	}
+
+	return NULL;
+}
+
+/* With a handful of entries, rebuilding beats tombstones */
+void ds5_device_remove(struct ds5_device *device)
+{
+	unsigned int i;
+
+	device->connected = 0;
+	device->port = 0;
+
+	memset(mac_table, 0, sizeof(mac_table));
+	for (i = 0; i < DS5_MAX_DEVICES; i++) {
+		if (ds5_devices[i].port)
+			mac_table_insert(i);
+	}
+}
+
+int ds5_pairing_save(unsigned int mac0, unsigned int mac1)
+{
+	unsigned int mac[2] = { mac0, mac1 };
+	SceUID fd;
+	int ret;
+
+	ksceIoMkdir(DS5_PAIRING_PATH, 6);
+	fd = ksceIoOpen(DS5_PAIRING_FILE, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 6);
+	if (fd < 0)
+		return fd;
+
+	ret = ksceIoWrite(fd, mac, sizeof(mac));
+	ksceIoClose(fd);
+
+	return ret == sizeof(mac) ? 0 : -1;
+}
+
+int ds5_pairing_load(unsigned int *mac0, unsigned int *mac1)
+{
+	unsigned int mac[2];
+	SceUID fd;
+	int ret;
+
+	fd = ksceIoOpen(DS5_PAIRING_FILE, SCE_O_RDONLY, 0);
+	if (fd < 0)
+		return fd;
+
+	ret = ksceIoRead(fd, mac, sizeof(mac));
+	ksceIoClose(fd);
+
+	if (ret != sizeof(mac) || (mac[0] == 0 && mac[1] == 0))
+		return -1;
+
+	*mac0 = mac[0];
+	*mac1 = mac[1];
+	return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <psp2kern/bt.h>
+#include "state.h"
+#include "output.h"
+#include "link.h"
+#include "motion.h"
+#include "touch.h"
+
+/* MAC of the last controller that connected, to reconnect it on load and resume */
+#define DS5_PAIRING_PATH "ux0:data/ds5vita/"
+#define DS5_PAIRING_FILE DS5_PAIRING_PATH "last_mac"
+
+/* One per SceCtrl port 1-4 */
+#define DS5_MAX_DEVICES 4
+
+/* Open addressing over twice the devices, keeps probe chains at ~1 */
+#define DS5_DEVICE_HASH_BITS 3
+#define DS5_DEVICE_HASH_SIZE (1 << DS5_DEVICE_HASH_BITS)
+
+#define DS5_RECV_BUFF_SIZE 0x100
+
+/* Reads kept posted per controller, so one is free while a report is processed */
+#define DS5_READ_DEPTH 4
+
+struct ds5_read {
+	SceBtHidRequest request;
+	unsigned char buff[DS5_RECV_BUFF_SIZE];
+};
+
+struct ds5_device {
+	volatile int connected;
+	unsigned int port; /* SceCtrl port, 1 to DS5_MAX_DEVICES */
+	unsigned int mac0;
+	unsigned int mac1;
+	int native;
+	unsigned int generation; /* bumped on every add, see ds5vitaGetState() */
+	unsigned int output_seq;
+	unsigned int crc_errors;
+	volatile unsigned int delivered; /* see ds5_stats_deliver() */
+
+	struct ds5_state last;    /* previous report, for the dirty flags */
+	unsigned int dirty;       /* DS5_DIRTY_* forced into the next report */
+	unsigned long long last_tick;
+	unsigned long long reconnect_start; /* page that brought it, until its first report */
+	unsigned long long buttons_sent; /* last emulation calls, port 1 only */
+	unsigned long long analog_sent;
+	struct ds5vita_emulation_stats emulation;
+
+	/* Posted in ring order, and expected to complete in the same order */
+	struct ds5_read reads[DS5_READ_DEPTH];
+	unsigned int read_head;
+	int reads_posted;
+	unsigned int read_skips; /* completions found ahead of read_head */
+	struct ds5_read calib;   /* motion calibration feature report */
+
+	struct ds5_history history;
+	struct ds5_output output;
+	struct ds5_link link;
+	struct ds5_motion motion;
+	struct ds5_touch touch;
+};
+
+/*
+ * The device for port p is always ds5_devices[p - 1], so the hooks index
+ * it directly. The MAC table is only used and changed by the BT thread.
+ */
+extern struct ds5_device ds5_devices[DS5_MAX_DEVICES];
+
+struct ds5_device *ds5_device_find(unsigned int mac0, unsigned int mac1);
+struct ds5_device *ds5_device_add(unsigned int mac0, unsigned int mac1);
+void ds5_device_remove(struct ds5_device *device);
+
+int ds5_pairing_save(unsigned int mac0, unsigned int mac1);
+int ds5_pairing_load(unsigned int *mac0, unsigned int *mac1);
+
+/* NULL unless a controller is connected on that port */
+static inline struct ds5_device *ds5_device_by_port(unsigned int port)
+{
+	struct ds5_device *device;
+
+	if (port - 1 >= DS5_MAX_DEVICES)
+		return NULL;
+
+	device = &ds5_devices[port - 1];
+	return device->connected ? device : NULL;
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef DS5VITA_H
+#define DS5VITA_H
+
+/*
+ * Exports of ds5vita: the stats in library ds5vitaForDriver, for other kernel
+ * plugins and tools, and the controller state in the syscall library ds5vita,
+ * for user apps. Link against the stubs generated from ds5vita.yml.
+ */
+
+/* Log2 buckets in microseconds: 0 is 0 us, b covers [2^(b-1), 2^b) us */
+#define DS5VITA_HIST_BUCKETS 24
+
+enum ds5vita_stage {
+	DS5VITA_STAGE_READ,    /* ksceBtReadEvent call */
+	DS5VITA_STAGE_DECODE,  /* event read to decoded and in the history */
+	DS5VITA_STAGE_EMULATE, /* ksceCtrlSet*Emulation calls */
+	DS5VITA_STAGE_DELIVER, /* event read to first handed to a game */
+	DS5VITA_STAGE_RECONNECT, /* resume or load to the first report of a known controller */
+	DS5VITA_STAGE_MAX
+};
+
+enum ds5vita_hook {
+	DS5VITA_HOOK_CTRL_PORT_INFO,
+	DS5VITA_HOOK_CTRL_BATTERY_INFO,
+	DS5VITA_HOOK_CTRL_PEEK_POSITIVE2,
+	DS5VITA_HOOK_CTRL_READ_POSITIVE2,
+	DS5VITA_HOOK_CTRL_PEEK_POSITIVE_EXT2,
+	DS5VITA_HOOK_CTRL_READ_POSITIVE_EXT2,
+	DS5VITA_HOOK_TOUCH_PEEK,
+	DS5VITA_HOOK_TOUCH_PEEK_REGION,
+	DS5VITA_HOOK_TOUCH_READ,
+	DS5VITA_HOOK_TOUCH_READ_REGION,
+	DS5VITA_HOOK_MOTION_GET_STATE,
+	DS5VITA_HOOK_MAX
+};
+
+struct ds5vita_histogram {
+	unsigned int bucket[DS5VITA_HIST_BUCKETS];
+	unsigned int count;
+	unsigned int max;
+	unsigned long long sum;
+};
+
+/* Time is what ds5vita adds on top of the original function */
+struct ds5vita_hook_stats {
+	unsigned int calls;
+	unsigned int max;
+	unsigned long long time;
+};
+
+struct ds5vita_latency_stats {
+	struct ds5vita_histogram stage[DS5VITA_STAGE_MAX];
+	struct ds5vita_hook_stats hook[DS5VITA_HOOK_MAX];
+};
+
+/* Sequence counter accounting of a controller's current connection */
+struct ds5vita_link_stats {
+	unsigned int received;     /* reports in sequence, after a gap or not */
+	unsigned int lost;         /* reports skipped by the sequence */
+	unsigned int gaps;         /* runs of one or more lost reports */
+	unsigned int duplicates;   /* same sequence number as the previous report */
+	unsigned int out_of_order; /* sequence number behind the previous report */
+	unsigned int interval;     /* mean inter-arrival time, us */
+	unsigned int jitter;       /* mean deviation from it, us */
+	unsigned int interval_max; /* longest inter-arrival time, us */
+};
+
+enum ds5vita_subsystem {
+	DS5VITA_SUBSYSTEM_BUTTONS,
+	DS5VITA_SUBSYSTEM_ANALOG,
+	DS5VITA_SUBSYSTEM_TOUCH,
+	DS5VITA_SUBSYSTEM_MOTION,
+	DS5VITA_SUBSYSTEM_BATTERY,
+	DS5VITA_SUBSYSTEM_MAX
+};
+
+/* How much per-report kernel work a controller's reports actually needed */
+struct ds5vita_emulation_stats {
+	unsigned int reports;
+	unsigned int dirty[DS5VITA_SUBSYSTEM_MAX]; /* reports that changed each subsystem */
+	unsigned int calls;   /* emulation and power tick calls made */
+	unsigned int skipped; /* calls left out, unchanged and still in effect */
+};
+
+struct ds5vita_finger {
+	unsigned char id;
+	unsigned char active;
+	unsigned short x; /* 0-1919 */
+	unsigned short y; /* 0-939 */
+};
+
+/* Everything decoded from a controller's latest report */
+struct ds5vita_state {
+	unsigned int seq;             /* changes with every new report, 0 before the first */
+	unsigned long long timestamp; /* arrival, ksceKernelGetSystemTimeWide() */
+	unsigned int buttons;         /* SceCtrl buttons, after remapping */
+	unsigned char lx, ly, rx, ry; /* after remapping and the response curves */
+	unsigned char lt, rt;
+	unsigned char battery_level;  /* 0-10 */
+	unsigned char usb_plugged;
+	unsigned char report_seq;     /* the controller's own report counter */
+	unsigned char reserved[3];
+	signed short accel[3];        /* x y z, raw */
+	signed short gyro[3];         /* x y z, raw */
+	struct ds5vita_finger finger[2];
+};
+
+/* Rumble and lightbar changes of a controller's current connection */
+struct ds5vita_output_stats {
+	unsigned int requested; /* setter calls */
+	unsigned int reports;   /* output reports sent */
+	unsigned int unchanged; /* merged changes that ended up as what was already sent */
+	unsigned int deferred;  /* sends pushed back by the rate limit */
+};
+
+/*
+ * User syscall. Copies the state of the controller on port 1-4 if its seq
+ * differs from the given one, the seq of the previous copy. Returns 1 if
+ * the state was copied, 0 if there was no new report, < 0 on error. The
+ * seq also changes when the controller reconnects, even on the same port.
+ */
+int ds5vitaGetState(unsigned int port, struct ds5vita_state *state, unsigned int size,
+		    unsigned int seq);
+
+/*
+ * User syscalls. Queue a rumble or lightbar change for the controller on
+ * port 1-4. Changes made faster than the output rate limit are merged,
+ * only the latest value is sent. Returns 0, or < 0 if there is no
+ * controller on the port.
+ */
+int ds5vitaSetRumble(unsigned int port, unsigned char right, unsigned char left);
+int ds5vitaSetLightBar(unsigned int port, unsigned char r, unsigned char g, unsigned char b);
+
+/* Copy a snapshot of the counters, size is sizeof(*stats) */
+int ds5vitaGetLatencyStats(struct ds5vita_latency_stats *stats, unsigned int size);
+int ds5vitaGetLinkStats(unsigned int port, struct ds5vita_link_stats *stats, unsigned int size);
+int ds5vitaGetEmulationStats(unsigned int port, struct ds5vita_emulation_stats *stats,
+			     unsigned int size);
+int ds5vitaGetOutputStats(unsigned int port, struct ds5vita_output_stats *stats,
+			  unsigned int size);
+
+/* Upper bound in microseconds of the bucket holding the given permille */
+static inline unsigned int ds5vita_histogram_percentile(const struct ds5vita_histogram *h,
+							unsigned int permille)
+{
+	unsigned long long target = ((unsigned long long)h->count * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < DS5VITA_HIST_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= target && seen > 0)
+			return b ? (1u << b) - 1 : 0;
+	}
+
+	return h->max;
+}
+
+#endif
@@ -0,0 +1,687 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "shim.h"
+#include "report.h"
+#include "crc32.h"
+#include "ds5vita.h"
+#include "device.h"
+
+#define MAC0 0x11223344
+#define MAC1 0x5566
+
+/* Virtual arrival interval of the synthesized reports, 250 Hz */
+#define REPORT_INTERVAL_US 4000
+
+/* Sequence number of the next synthesized report, kept across benchmarks */
+static unsigned int report_seq;
+static unsigned long long report_time;
+
+#define NID_PEEK_BUFFER_POSITIVE2 0x15F81E8C
+#define NID_TOUCH_PEEK            0xBAD1960B
+#define NID_MOTION_GET_STATE      0xBDB32767
+
+extern int module_start(SceSize argc, const void *args);
+extern int module_stop(SceSize argc, const void *args);
+
+typedef int (*ctrl_hook_t)(int port, SceCtrlData *pad_data, int count);
+typedef int (*touch_hook_t)(SceUInt32 port, SceTouchData *pData, SceUInt32 nBufs);
+typedef int (*motion_hook_t)(SceMotionState *motionState);
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Synthesizes a 0x11 report with moving sticks and rotating buttons */
+static void make_report(unsigned char *report, unsigned int i)
+{
+	memset(report, 0, 0x100);
+
+	report[0] = 0x11;
+	report[1] = 128 + ((i * 7) & 0x3F) - 32;
+	report[2] = 128 - ((i * 5) & 0x3F) + 32;
+	report[3] = 128;
+	report[4] = 128 + ((i >> 3) & 0x07);
+	report[5] = (i & 0x07) | ((i << 1) & 0xF0);
+	report[6] = (i >> 4) & 0xFF;
+	report[7] = ((i >> 8) & 0x03) | ((i & 0x3F) << 2);
+	report[8] = (i * 3) & 0xFF;
+	report[9] = 0;
+}
+
+static void put_s16(unsigned char *p, int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+/*
+ * DS4 Bluetooth layout: no gyro bias but a small one, 540 deg/s at 8847
+ * LSB, and the accel x axis 100 LSB off and 8200 LSB per g.
+ */
+static void make_calib_report(unsigned char *report)
+{
+	static const unsigned char hdr = 0xA3;
+	unsigned int i, crc;
+
+	memset(report, 0, DS5_CALIB_REPORT_SIZE);
+	report[0] = DS5_CALIB_REPORT_ID;
+
+	for (i = 0; i < 3; i++) {
+		put_s16(report + 1 + 2 * i, 2);
+		put_s16(report + 7 + 2 * i, 8847);
+		put_s16(report + 13 + 2 * i, -8847);
+		put_s16(report + 23 + 4 * i, i == 0 ? 8300 : 8192);
+		put_s16(report + 25 + 4 * i, i == 0 ? -8100 : -8192);
+	}
+	put_s16(report + 19, 540);
+	put_s16(report + 21, 540);
+
+	crc = crc32_update(0xFFFFFFFF, &hdr, 1);
+	crc = ~crc32_update(crc, report, DS5_CALIB_REPORT_SIZE - 4);
+	memcpy(&report[DS5_CALIB_REPORT_SIZE - 4], &crc, sizeof(crc));
+}
+
+static void print_counts(const char *what, unsigned long n)
+{
+	int i;
+
+	printf("  kernel calls per %s:\n", what);
+	for (i = 0; i < SHIM_CALL_MAX; i++) {
+		unsigned long count = shim_call_count(i);
+		if (count)
+			printf("    %-32s %.2f\n", shim_call_name(i), (double)count / n);
+	}
+}
+
+static void bench_reports(unsigned int n)
+{
+	unsigned char report[0x100];
+	unsigned long long start, total = 0;
+	unsigned int i;
+
+	shim_reset_counts();
+
+	for (i = 0; i < n; i++) {
+		make_report(report, report_seq++);
+		report_time += REPORT_INTERVAL_US;
+		shim_set_time(report_time);
+
+		start = now_ns();
+		if (shim_bt_push_report(MAC0, MAC1, report, sizeof(report)) < 0) {
+			fprintf(stderr, "no read request armed at report %u\n", i);
+			exit(1);
+		}
+		shim_bt_notify();
+		total += now_ns() - start;
+	}
+
+	printf("bt_cb_func: %u reports, %.1f ns/report\n", n, (double)total / n);
+	print_counts("report", n);
+}
+
+/*
+ * The same report over and over, only the counter moves: a controller left
+ * on the table, or with held set, the left stick at full tilt and cross held.
+ * Held input must still be sent before its emulation expires.
+ */
+static void bench_idle(unsigned int n, int held)
+{
+	struct ds5vita_emulation_stats before, after;
+	unsigned char report[0x100];
+	unsigned int i;
+
+	ds5vitaGetEmulationStats(1, &before, sizeof(before));
+	shim_reset_counts();
+
+	for (i = 0; i < n; i++) {
+		memset(report, 0, sizeof(report));
+		report[0] = 0x11;
+		memset(&report[1], 0x80, 4);
+		report[5] = 0x08;
+		if (held) {
+			report[1] = 0xFF;
+			report[5] |= 0x20;
+		}
+		report[7] = (report_seq++ & 0x3F) << 2;
+		report[35] = report[39] = 0x80; /* no fingers */
+
+		report_time += REPORT_INTERVAL_US;
+		shim_set_time(report_time);
+		shim_bt_push_report(MAC0, MAC1, report, sizeof(report));
+		shim_bt_notify();
+	}
+
+	ds5vitaGetEmulationStats(1, &after, sizeof(after));
+	printf("%s: %u reports, %u kernel calls made, %u skipped\n",
+		held ? "held" : "idle", after.reports - before.reports, after.calls - before.calls,
+		after.skipped - before.skipped);
+	print_counts("report", n);
+}
+
+/* Reports arriving back to back while the BT thread is still busy */
+static void bench_burst(unsigned int n, unsigned int burst)
+{
+	struct ds5vita_link_stats before, after;
+	unsigned char report[0x100];
+	unsigned int i, j, missed = 0;
+
+	ds5vitaGetLinkStats(1, &before, sizeof(before));
+
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < burst; j++) {
+			make_report(report, report_seq++);
+			report_time += REPORT_INTERVAL_US / burst;
+			shim_set_time(report_time);
+			missed += shim_bt_push_report(MAC0, MAC1, report, sizeof(report)) < 0;
+		}
+		shim_bt_notify();
+	}
+
+	ds5vitaGetLinkStats(1, &after, sizeof(after));
+	printf("burst of %u: %u of %u reports found no read posted, %u lost\n", burst,
+		missed, n * burst, after.lost - before.lost);
+}
+
+/*
+ * The decoder from before the lookup tables, kept as the reference for
+ * bench_decode: one branch per button and per axis test, bitfield reads
+ * for the rest. It fills the same state as ds5_decode_report with the
+ * default mapping, except that the deadzone only snaps to rest.
+ */
+#define CASCADE_THRESHOLD 3
+#define DECODE_REPORTS 4096
+
+static unsigned char cascade_stick(unsigned char v, unsigned int bit, unsigned char *moved)
+{
+	if (abs(v - 128) <= CASCADE_THRESHOLD)
+		return 128;
+	*moved |= bit;
+	return v;
+}
+
+static unsigned char cascade_trigger(unsigned char v, unsigned int bit, unsigned char *moved)
+{
+	if (v <= CASCADE_THRESHOLD)
+		return 0;
+	*moved |= bit;
+	return v;
+}
+
+static void decode_cascade(const struct ds5_input_report *ds5, struct ds5_state *state)
+{
+	unsigned int buttons = 0;
+
+	if (ds5->cross)
+		buttons |= SCE_CTRL_CROSS;
+	if (ds5->circle)
+		buttons |= SCE_CTRL_CIRCLE;
+	if (ds5->triangle)
+		buttons |= SCE_CTRL_TRIANGLE;
+	if (ds5->square)
+		buttons |= SCE_CTRL_SQUARE;
+
+	if (ds5->dpad == 0 || ds5->dpad == 1 || ds5->dpad == 7)
+		buttons |= SCE_CTRL_UP;
+	if (ds5->dpad == 1 || ds5->dpad == 2 || ds5->dpad == 3)
+		buttons |= SCE_CTRL_RIGHT;
+	if (ds5->dpad == 3 || ds5->dpad == 4 || ds5->dpad == 5)
+		buttons |= SCE_CTRL_DOWN;
+	if (ds5->dpad == 5 || ds5->dpad == 6 || ds5->dpad == 7)
+		buttons |= SCE_CTRL_LEFT;
+
+	if (ds5->l1)
+		buttons |= SCE_CTRL_L1;
+	if (ds5->r1)
+		buttons |= SCE_CTRL_R1;
+
+	if (ds5->l2)
+		buttons |= SCE_CTRL_LTRIGGER;
+	if (ds5->r2)
+		buttons |= SCE_CTRL_RTRIGGER;
+
+	if (ds5->l3)
+		buttons |= SCE_CTRL_L3;
+	if (ds5->r3)
+		buttons |= SCE_CTRL_R3;
+
+	if (ds5->share)
+		buttons |= SCE_CTRL_SELECT;
+	if (ds5->options)
+		buttons |= SCE_CTRL_START;
+	if (ds5->ps)
+		buttons |= SCE_CTRL_INTERCEPTED;
+
+	state->buttons = buttons;
+
+	state->moved = 0;
+	state->lx = cascade_stick(ds5->left_x, DS5_MOVED_LX, &state->moved);
+	state->ly = cascade_stick(ds5->left_y, DS5_MOVED_LY, &state->moved);
+	state->rx = cascade_stick(ds5->right_x, DS5_MOVED_RX, &state->moved);
+	state->ry = cascade_stick(ds5->right_y, DS5_MOVED_RY, &state->moved);
+	state->lt = cascade_trigger(ds5->l_trigger, DS5_MOVED_LT, &state->moved);
+	state->rt = cascade_trigger(ds5->r_trigger, DS5_MOVED_RT, &state->moved);
+
+	ds5_state_pack_analog(state);
+	state->sticks_mask = (state->moved & DS5_MOVED_LX ? 0x000000FF : 0) |
+		(state->moved & DS5_MOVED_LY ? 0x0000FF00 : 0) |
+		(state->moved & DS5_MOVED_RX ? 0x00FF0000 : 0) |
+		(state->moved & DS5_MOVED_RY ? 0xFF000000 : 0);
+	state->triggers_mask = (state->moved & DS5_MOVED_LT ? 0x00FF : 0) |
+		(state->moved & DS5_MOVED_RT ? 0xFF00 : 0);
+
+	state->battery_level = ds5->battery_level;
+	state->usb_plugged = ds5->usb_plugged;
+	state->seq = ds5->cnt1;
+
+	state->accel[0] = ds5->accel_x;
+	state->accel[1] = ds5->accel_y;
+	state->accel[2] = ds5->accel_z;
+	state->gyro[0] = ds5->gyro_x;
+	state->gyro[1] = ds5->gyro_y;
+	state->gyro[2] = ds5->gyro_z;
+
+	state->finger[0].id = ds5->finger1_id;
+	state->finger[0].active = !ds5->finger1_activelow;
+	state->finger[0].x = ds5->finger1_x;
+	state->finger[0].y = ds5->finger1_y;
+	state->finger[1].id = ds5->finger2_id;
+	state->finger[1].active = !ds5->finger2_activelow;
+	state->finger[1].x = ds5->finger2_x;
+	state->finger[1].y = ds5->finger2_y;
+}
+
+/* Everything but the stick values, which the response curve may rescale */
+static int cascade_differs(const struct ds5_state *a, const struct ds5_state *b)
+{
+	return a->buttons != b->buttons || a->moved != b->moved ||
+		a->sticks_mask != b->sticks_mask || a->triggers_mask != b->triggers_mask ||
+		a->battery_level != b->battery_level || a->usb_plugged != b->usb_plugged ||
+		a->seq != b->seq ||
+		memcmp(a->accel, b->accel, sizeof(a->accel)) != 0 ||
+		memcmp(a->gyro, b->gyro, sizeof(a->gyro)) != 0 ||
+		memcmp(a->finger, b->finger, sizeof(a->finger)) != 0;
+}
+
+static void bench_decode(unsigned int n)
+{
+	static unsigned char reports[DECODE_REPORTS][0x100] __attribute__((aligned(32)));
+	struct ds5_state state, ref;
+	unsigned long long start, tables, cascade;
+	unsigned int i, j, sink = 0, mismatches = 0;
+
+	/* Random input, so the branch predictor cannot learn the cascade */
+	srand(1);
+	for (i = 0; i < DECODE_REPORTS; i++) {
+		reports[i][0] = 0x11;
+		for (j = 1; j < sizeof(struct ds5_input_report); j++)
+			reports[i][j] = rand();
+	}
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		ds5_decode_report(reports[i % DECODE_REPORTS], &ds5_layout_0x11, &state);
+		sink += state.buttons + state.moved;
+	}
+	tables = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		decode_cascade((const struct ds5_input_report *)reports[i % DECODE_REPORTS], &ref);
+		sink += ref.buttons + ref.moved;
+	}
+	cascade = now_ns() - start;
+
+	for (i = 0; i < DECODE_REPORTS; i++) {
+		ds5_decode_report(reports[i], &ds5_layout_0x11, &state);
+		decode_cascade((const struct ds5_input_report *)reports[i], &ref);
+		mismatches += cascade_differs(&state, &ref);
+	}
+
+	printf("ds5_decode_report: %.2f ns/report, if-cascade before it: %.2f ns/report "
+		"(%u of %u differ, %u)\n", (double)tables / n, (double)cascade / n,
+		mismatches, DECODE_REPORTS, sink & 1);
+}
+
+static void bench_crc(unsigned int n)
+{
+	static const unsigned char hdr = 0xA1;
+	unsigned char report[DS5_0x31_REPORT_SIZE];
+	unsigned long long start;
+	unsigned int i, crc, ok = 0;
+
+	for (i = 0; i < sizeof(report); i++)
+		report[i] = i * 31;
+	report[0] = 0x31;
+
+	crc = crc32_update(0xFFFFFFFF, &hdr, 1);
+	crc = ~crc32_update(crc, report, sizeof(report) - 4);
+	memcpy(&report[sizeof(report) - 4], &crc, sizeof(crc));
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		ok += ds5_report_crc_ok(report, &ds5_layout_0x31);
+
+	printf("ds5_report_crc_ok (0x31): %.2f ns/report (%u)\n",
+		(double)(now_ns() - start) / n, ok);
+}
+
+static void bench_ctrl_hook(unsigned int n, int count)
+{
+	ctrl_hook_t hook = (ctrl_hook_t)shim_find_export_hook(NID_PEEK_BUFFER_POSITIVE2);
+	SceCtrlData *pad_data = calloc(count, sizeof(*pad_data));
+	unsigned long long start;
+	unsigned int i;
+
+	/* One buffered entry per 60 Hz frame, the newest one being now */
+	for (i = 0; i < count; i++)
+		pad_data[i].timeStamp = ksceKernelGetSystemTimeWide() - (count - 1 - i) * 16667;
+
+	shim_reset_counts();
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		hook(0, pad_data, count);
+
+	printf("sceCtrlPeekBufferPositive2 count=%d: %.1f ns/call\n", count,
+		(double)(now_ns() - start) / n);
+	print_counts("call", n);
+
+	free(pad_data);
+}
+
+static void bench_touch_hook(unsigned int n, int count)
+{
+	touch_hook_t hook = (touch_hook_t)shim_find_export_hook(NID_TOUCH_PEEK);
+	SceTouchData *data = calloc(count, sizeof(*data));
+	unsigned long long start;
+	unsigned int i;
+
+	shim_reset_counts();
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		hook(SCE_TOUCH_PORT_FRONT, data, count);
+
+	printf("ksceTouchPeek nBufs=%d: %.1f ns/call\n", count,
+		(double)(now_ns() - start) / n);
+	print_counts("call", n);
+
+	free(data);
+}
+
+static void bench_motion_hook(unsigned int n)
+{
+	motion_hook_t hook = (motion_hook_t)shim_find_export_hook(NID_MOTION_GET_STATE);
+	SceMotionState state;
+	unsigned long long start;
+	unsigned int i;
+
+	memset(&state, 0, sizeof(state));
+	shim_reset_counts();
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		hook(&state);
+
+	printf("sceMotionGetState: %.1f ns/call\n", (double)(now_ns() - start) / n);
+
+	/* The reports carry a raw 0, the calibration puts x 100 LSB off */
+	printf("  accel at rest: %.4f %.4f %.4f g (expect 0.0121 0 0)\n",
+		state.acceleration.x, state.acceleration.y, state.acceleration.z);
+	print_counts("call", n);
+}
+
+/* Polling the full state, once with a new report each time and once without */
+static void bench_get_state(unsigned int n)
+{
+	struct ds5vita_state state;
+	unsigned long long start;
+	unsigned int i, copies = 0;
+
+	memset(&state, 0, sizeof(state));
+	shim_reset_counts();
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		copies += ds5vitaGetState(1, &state, sizeof(state), 0) == 1;
+
+	printf("ds5vitaGetState new: %.1f ns/call (%u copied)\n",
+		(double)(now_ns() - start) / n, copies);
+	print_counts("call", n);
+
+	copies = 0;
+	shim_reset_counts();
+
+	start = now_ns();
+	for (i = 0; i < n; i++)
+		copies += ds5vitaGetState(1, &state, sizeof(state), state.seq) == 1;
+
+	printf("ds5vitaGetState unchanged: %.1f ns/call (%u copied)\n",
+		(double)(now_ns() - start) / n, copies);
+	print_counts("call", n);
+}
+
+/* A game polling at 60 Hz against 250 Hz reports, as seen through the export */
+static void bench_latency(unsigned int n)
+{
+	ctrl_hook_t hook = (ctrl_hook_t)shim_find_export_hook(NID_PEEK_BUFFER_POSITIVE2);
+	struct ds5vita_latency_stats stats;
+	const struct ds5vita_histogram *h = &stats.stage[DS5VITA_STAGE_DELIVER];
+	unsigned char report[0x100];
+	unsigned long long next_frame = report_time;
+	unsigned int i, count;
+	SceCtrlData pad_data;
+
+	ds5vitaGetLatencyStats(&stats, sizeof(stats));
+	count = h->count;
+
+	for (i = 0; i < n; i++) {
+		unsigned long long t = report_time += REPORT_INTERVAL_US;
+
+		make_report(report, report_seq++);
+		shim_set_time(t);
+		shim_bt_push_report(MAC0, MAC1, report, sizeof(report));
+		shim_bt_notify();
+
+		while (next_frame < t + REPORT_INTERVAL_US) {
+			if (next_frame >= t) {
+				shim_set_time(next_frame);
+				memset(&pad_data, 0, sizeof(pad_data));
+				pad_data.timeStamp = next_frame;
+				hook(0, &pad_data, 1);
+			}
+			next_frame += 16667;
+		}
+	}
+
+	ds5vitaGetLatencyStats(&stats, sizeof(stats));
+	printf("delivery latency: %u reports seen by the game, p50 <= %u us, p99 <= %u us, max %u us\n",
+		h->count - count, ds5vita_histogram_percentile(h, 500),
+		ds5vita_histogram_percentile(h, 990), h->max);
+}
+
+/*
+ * Known radio conditions: every 50th report lost, every 97th repeated,
+ * a 1 s dropout, and +-500 us of arrival jitter.
+ */
+static void bench_link(unsigned int n)
+{
+	struct ds5vita_link_stats before, after;
+	unsigned char report[0x100];
+	unsigned int i;
+
+	ds5vitaGetLinkStats(1, &before, sizeof(before));
+
+	for (i = 0; i < n; i++) {
+		unsigned int seq;
+		int jitter;
+
+		/* The controller keeps counting while out of range */
+		if (i == n / 2) {
+			report_seq += 250;
+			report_time += 250 * REPORT_INTERVAL_US;
+		}
+
+		seq = report_seq++;
+		jitter = (int)((seq * 2654435761u) >> 22) - 512;
+		report_time += REPORT_INTERVAL_US;
+		if (seq % 50 == 0)
+			continue;
+
+		make_report(report, seq);
+		shim_set_time(report_time + jitter);
+		shim_bt_push_report(MAC0, MAC1, report, sizeof(report));
+		shim_bt_notify();
+
+		if (seq % 97 == 0) {
+			shim_bt_push_report(MAC0, MAC1, report, sizeof(report));
+			shim_bt_notify();
+		}
+	}
+
+	ds5vitaGetLinkStats(1, &after, sizeof(after));
+	printf("link: %u received, %u lost in %u gaps, %u duplicates, %u out of order\n",
+		after.received - before.received, after.lost - before.lost,
+		after.gaps - before.gaps, after.duplicates - before.duplicates,
+		after.out_of_order - before.out_of_order);
+	printf("link: %u us mean interval, %u us jitter, %u us max\n",
+		after.interval, after.jitter, after.interval_max);
+}
+
+/*
+ * A game setting the rumble every 1 ms, flipping it every 5 ms. The BT
+ * thread should send at most one report per output interval (10 ms unless
+ * config.txt sets output_rate) and end on the last value.
+ */
+static void bench_output(unsigned int n)
+{
+	struct ds5vita_output_stats before, after;
+	unsigned long long start = report_time;
+	unsigned int interval = ds5_devices[0].output.min_interval;
+	unsigned int i;
+
+	ds5vitaGetOutputStats(1, &before, sizeof(before));
+
+	for (i = 0; i < n; i++) {
+		report_time += 1000;
+		shim_set_time(report_time);
+		ds5vitaSetRumble(1, (i / 5) & 1 ? 0xFF : 0x00, 0x00);
+
+		/* Give the BT thread its turn, virtual time only moves here */
+		usleep(50);
+
+		/* Deliver the output replies before they fill the shim event queue */
+		shim_bt_notify();
+	}
+
+	/* Let the last change out */
+	report_time += interval;
+	shim_set_time(report_time);
+	usleep(20000);
+	shim_bt_notify();
+
+	ds5vitaGetOutputStats(1, &after, sizeof(after));
+	printf("output: %u requested, %u reports (limit %llu), %u unchanged, %u deferred\n",
+		after.requested - before.requested, after.reports - before.reports,
+		(report_time - start) / interval + 1,
+		after.unchanged - before.unchanged, after.deferred - before.deferred);
+}
+
+/*
+ * Suspend and resume with the controller still on. The page goes out as soon
+ * as the BT thread sees the resume, the radio time is a nominal 200 ms.
+ */
+static void bench_resume(void)
+{
+	struct ds5vita_latency_stats stats;
+	const struct ds5vita_histogram *h = &stats.stage[DS5VITA_STAGE_RECONNECT];
+	unsigned char report[0x100];
+	unsigned long connects;
+
+	/* The BT thread handles the suspend first, the page means both are done */
+	connects = shim_call_count(SHIM_CALL_BT_CONNECT);
+	shim_set_time(report_time);
+	shim_sysevent(0);
+	shim_sysevent(1);
+	while (shim_call_count(SHIM_CALL_BT_CONNECT) == connects)
+		usleep(100);
+
+	report_time += 200000;
+	shim_set_time(report_time);
+	shim_bt_push_event(0x05, MAC0, MAC1);
+	shim_bt_notify();
+
+	report_time += REPORT_INTERVAL_US;
+	make_report(report, report_seq++);
+	shim_set_time(report_time);
+	shim_bt_push_report(MAC0, MAC1, report, sizeof(report));
+	shim_bt_notify();
+
+	ds5vitaGetLatencyStats(&stats, sizeof(stats));
+	printf("resume: %lu connects issued, first report %u us after the resume\n",
+		shim_call_count(SHIM_CALL_BT_CONNECT) - connects, h->max);
+}
+
+static const char *hooks_state(void)
+{
+	return shim_find_export_hook(NID_PEEK_BUFFER_POSITIVE2) ? "attached" : "none";
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int n = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	unsigned char calib[DS5_CALIB_REPORT_SIZE];
+	unsigned long long start;
+	int count;
+
+	/* Virtual time from the start, a saved pairing is paged on load */
+	report_time = 1000000;
+	shim_set_time(report_time);
+	module_start(0, NULL);
+
+	/* After module_start, which builds the CRC tables */
+	make_calib_report(calib);
+	shim_bt_set_feature(calib, sizeof(calib));
+
+	/* The input hooks are attached with the first controller, and stay */
+	printf("input hooks: %s before connect, ", hooks_state());
+	shim_bt_push_event(0x05, MAC0, MAC1);
+	shim_bt_notify();
+	printf("%s once connected, ", hooks_state());
+	shim_bt_push_event(0x06, MAC0, MAC1);
+	shim_bt_notify();
+	printf("%s after disconnect\n", hooks_state());
+
+	/* Connect, the 0x0B reply to the LED report arms the first reads */
+	shim_bt_push_event(0x05, MAC0, MAC1);
+	shim_bt_notify();
+
+	bench_decode(n * 10);
+	bench_crc(n * 10);
+	bench_reports(n);
+	bench_idle(n, 0);
+	bench_idle(n, 1);
+	bench_burst(n / 10, 3);
+	for (count = 1; count <= 64; count *= 2)
+		bench_ctrl_hook(n / count, count);
+	for (count = 1; count <= 64; count *= 2)
+		bench_touch_hook(n / count, count);
+	bench_motion_hook(n);
+	bench_get_state(n);
+	bench_latency(n / 10);
+	bench_link(n / 10);
+	bench_output(n / 10);
+	bench_resume();
+
+	start = now_ns();
+	module_stop(0, NULL);
+	printf("module_stop: %.1f ms\n", (now_ns() - start) / 1e6);
+
+	return 0;
+}
@@ -0,0 +1,358 @@
+#ifndef SHIM_H
+#define SHIM_H
+
+/*
+ * Minimal stand-in for the psp2kern/taiHEN API surface used by ds5vita,
+ * so the input pipeline can be built and exercised on the host.
+ * Every emulated kernel call is counted, see shim_call_count().
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef int SceUID;
+typedef unsigned int SceSize;
+typedef unsigned int SceUInt;
+typedef uint8_t SceUInt8;
+typedef uint16_t SceUInt16;
+typedef uint32_t SceUInt32;
+typedef uint64_t SceUInt64;
+typedef int64_t SceInt64;
+
+#define KERNEL_PID 0x10005
+
+#define SCE_KERNEL_START_SUCCESS 0
+#define SCE_KERNEL_START_FAILED  2
+#define SCE_KERNEL_STOP_SUCCESS  0
+#define SCE_KERNEL_STOP_FAIL     1
+
+/* modulemgr / taiHEN */
+
+typedef uintptr_t tai_hook_ref_t;
+
+typedef struct {
+	size_t size;
+	SceUID modid;
+	uint32_t module_nid;
+	char name[27];
+} tai_module_info_t;
+
+#define TAI_ANY_LIBRARY 0xFFFFFFFF
+
+#define TAI_CONTINUE(type, h, ...) (((type (*)())(h))(__VA_ARGS__))
+
+int taiGetModuleInfoForKernel(SceUID pid, const char *module, tai_module_info_t *info);
+SceUID taiHookFunctionExportForKernel(SceUID pid, tai_hook_ref_t *p_hook,
+	const char *module, uint32_t library_nid, uint32_t func_nid, const void *hook_func);
+SceUID taiHookFunctionOffsetForKernel(SceUID pid, tai_hook_ref_t *p_hook,
+	SceUID modid, int segidx, uint32_t offset, int thumb, const void *hook_func);
+int taiHookReleaseForKernel(SceUID tai_uid, tai_hook_ref_t hook);
+
+/* threadmgr */
+
+typedef int (*SceKernelThreadEntry)(SceSize args, void *argp);
+typedef int (*SceKernelCallbackFunction)(int notifyId, int notifyCount,
+	int notifyArg, void *common);
+
+SceUID ksceKernelCreateThread(const char *name, SceKernelThreadEntry entry,
+	int initPriority, SceSize stackSize, SceUInt attr, int cpuAffinityMask,
+	const void *option);
+int ksceKernelStartThread(SceUID thid, SceSize arglen, void *argp);
+int ksceKernelWaitThreadEnd(SceUID thid, int *stat, SceUInt *timeout);
+int ksceKernelDeleteThread(SceUID thid);
+int ksceKernelDelayThread(SceUInt delay);
+int ksceKernelDelayThreadCB(SceUInt delay);
+SceUID ksceKernelCreateCallback(const char *name, unsigned int attr,
+	SceKernelCallbackFunction func, void *arg);
+int ksceKernelDeleteCallback(SceUID cb);
+SceInt64 ksceKernelGetSystemTimeWide(void);
+
+#define SCE_EVENT_WAITAND       0x00000000
+#define SCE_EVENT_WAITOR        0x00000001
+#define SCE_EVENT_WAITCLEAR     0x00000002
+#define SCE_EVENT_WAITCLEAR_PAT 0x00000004
+
+#define SCE_KERNEL_ERROR_WAIT_TIMEOUT 0x80028005
+
+typedef struct SceKernelEventFlagOptParam {
+	SceSize size;
+} SceKernelEventFlagOptParam;
+
+SceUID ksceKernelCreateEventFlag(const char *name, int attr, int bits,
+	SceKernelEventFlagOptParam *opt);
+int ksceKernelDeleteEventFlag(SceUID evfId);
+int ksceKernelSetEventFlag(SceUID evfId, unsigned int bits);
+int ksceKernelClearEventFlag(SceUID evfId, unsigned int bits);
+int ksceKernelWaitEventFlagCB(SceUID evfId, unsigned int bits, unsigned int wait,
+	unsigned int *outBits, SceUInt *timeout);
+int ksceKernelWaitEventFlag(SceUID evfId, unsigned int bits, unsigned int wait,
+	unsigned int *outBits, SceUInt *timeout);
+
+/* sysmem */
+
+typedef struct SceKernelHeapCreateOpt {
+	SceSize size;
+	SceUInt32 uselock;
+	SceUInt32 field_8;
+	SceUInt32 field_C;
+	SceUInt32 field_10;
+	SceUInt32 field_14;
+	SceUInt32 field_18;
+} SceKernelHeapCreateOpt;
+
+SceUID ksceKernelCreateHeap(const char *name, SceSize size, SceKernelHeapCreateOpt *opt);
+int ksceKernelDeleteHeap(SceUID uid);
+void *ksceKernelAllocHeapMemory(SceUID uid, SceSize size);
+void ksceKernelFreeHeapMemory(SceUID uid, void *ptr);
+int ksceKernelMemcpyUserToKernel(void *dst, uintptr_t src, SceSize len);
+int ksceKernelMemcpyKernelToUser(uintptr_t dst, const void *src, SceSize len);
+
+/* cpu */
+
+/* Only switch the TLS of the calling thread on the Vita */
+#define ENTER_SYSCALL(state) do { (state) = 0; } while (0)
+#define EXIT_SYSCALL(state)  do { (void)(state); } while (0)
+
+/* suspend */
+
+typedef int (*SceSysEventHandler)(int resume, int eventid, void *args, void *opt);
+
+int ksceKernelPowerTick(int type);
+SceUID ksceKernelRegisterSysEventHandler(const char *name, SceSysEventHandler handler,
+	void *args);
+void ksceKernelUnregisterSysEventHandler(SceUID id);
+
+/* io */
+
+#define SCE_O_RDONLY 0x0001
+#define SCE_O_WRONLY 0x0002
+#define SCE_O_RDWR   (SCE_O_RDONLY | SCE_O_WRONLY)
+#define SCE_O_APPEND 0x0100
+#define SCE_O_CREAT  0x0200
+#define SCE_O_TRUNC  0x0400
+
+SceUID ksceIoOpen(const char *file, int flags, int mode);
+int ksceIoClose(SceUID fd);
+int ksceIoRead(SceUID fd, void *data, SceSize size);
+int ksceIoWrite(SceUID fd, const void *data, SceSize size);
+int ksceIoMkdir(const char *dir, int mode);
+
+/* bt */
+
+#define SCE_BT_ERROR_CB_OVERFLOW 0x802F0C01
+
+typedef struct SceBtEvent {
+	union {
+		unsigned char data[0x10];
+		struct {
+			unsigned char id;
+			unsigned char unk1;
+			unsigned short unk2;
+			unsigned int unk3;
+			unsigned int mac0;
+			unsigned int mac1;
+		};
+	};
+} SceBtEvent;
+
+typedef struct SceBtHidRequest {
+	unsigned int unk00;
+	unsigned int unk04;
+	unsigned char type;
+	unsigned char unk09;
+	unsigned char unk0A;
+	unsigned char unk0B;
+	void *buffer;
+	unsigned int length;
+	struct SceBtHidRequest *next;
+} SceBtHidRequest;
+
+int ksceBtReadEvent(SceBtEvent *events, int num_events);
+int ksceBtHidTransfer(unsigned int mac0, unsigned int mac1, SceBtHidRequest *request);
+int ksceBtGetVidPid(unsigned int mac0, unsigned int mac1, unsigned short vid_pid[2]);
+int ksceBtStartInquiry(void);
+int ksceBtStopInquiry(void);
+int ksceBtStartConnect(unsigned int mac0, unsigned int mac1);
+int ksceBtStartDisconnect(unsigned int mac0, unsigned int mac1);
+int ksceBtReplyUserConfirmation(unsigned int mac0, unsigned int mac1, int unk);
+int ksceBtRegisterCallback(SceUID cb, int unused, int flags1, int flags2);
+int ksceBtUnregisterCallback(SceUID cb);
+
+/* ctrl */
+
+enum {
+	SCE_CTRL_SELECT      = 0x00000001,
+	SCE_CTRL_L3          = 0x00000002,
+	SCE_CTRL_R3          = 0x00000004,
+	SCE_CTRL_START       = 0x00000008,
+	SCE_CTRL_UP          = 0x00000010,
+	SCE_CTRL_RIGHT       = 0x00000020,
+	SCE_CTRL_DOWN        = 0x00000040,
+	SCE_CTRL_LEFT        = 0x00000080,
+	SCE_CTRL_LTRIGGER    = 0x00000100,
+	SCE_CTRL_RTRIGGER    = 0x00000200,
+	SCE_CTRL_L1          = 0x00000400,
+	SCE_CTRL_R1          = 0x00000800,
+	SCE_CTRL_TRIANGLE    = 0x00001000,
+	SCE_CTRL_CIRCLE      = 0x00002000,
+	SCE_CTRL_CROSS       = 0x00004000,
+	SCE_CTRL_SQUARE      = 0x00008000,
+	SCE_CTRL_INTERCEPTED = 0x00010000,
+};
+
+#define SCE_CTRL_TYPE_DS4 8
+
+typedef struct SceCtrlData {
+	uint64_t timeStamp;
+	unsigned int buttons;
+	unsigned char lx;
+	unsigned char ly;
+	unsigned char rx;
+	unsigned char ry;
+	uint8_t up;
+	uint8_t right;
+	uint8_t down;
+	uint8_t left;
+	uint8_t lt;
+	uint8_t rt;
+	uint8_t l1;
+	uint8_t r1;
+	uint8_t triangle;
+	uint8_t circle;
+	uint8_t cross;
+	uint8_t square;
+	uint8_t reserved[4];
+} SceCtrlData;
+
+typedef struct SceCtrlPortInfo {
+	uint8_t port[5];
+	uint8_t unk[11];
+} SceCtrlPortInfo;
+
+int ksceCtrlSetButtonEmulation(unsigned int port, unsigned char slot,
+	unsigned int userButtons, unsigned int kernelButtons, unsigned int uiMake);
+int ksceCtrlSetAnalogEmulation(unsigned int port, unsigned char slot,
+	unsigned char user_lX, unsigned char user_lY,
+	unsigned char user_rX, unsigned char user_rY,
+	unsigned char kernel_lX, unsigned char kernel_lY,
+	unsigned char kernel_rX, unsigned char kernel_rY, unsigned int uiMake);
+
+/* touch */
+
+#define SCE_TOUCH_MAX_REPORT 8
+
+typedef enum SceTouchPortType {
+	SCE_TOUCH_PORT_FRONT = 0,
+	SCE_TOUCH_PORT_BACK  = 1,
+} SceTouchPortType;
+
+typedef struct SceTouchReport {
+	SceUInt8 id;
+	SceUInt8 force;
+	SceUInt16 x;
+	SceUInt16 y;
+	SceUInt8 reserved[8];
+	SceUInt16 info;
+} SceTouchReport;
+
+typedef struct SceTouchData {
+	SceUInt64 timeStamp;
+	SceUInt32 status;
+	SceUInt32 reportNum;
+	SceTouchReport report[SCE_TOUCH_MAX_REPORT];
+} SceTouchData;
+
+/* motion */
+
+typedef struct SceFVector3 {
+	float x;
+	float y;
+	float z;
+} SceFVector3;
+
+typedef struct SceFQuaternion {
+	float x;
+	float y;
+	float z;
+	float w;
+} SceFQuaternion;
+
+typedef struct SceFVector4 {
+	float x;
+	float y;
+	float z;
+	float w;
+} SceFVector4;
+
+typedef struct SceUMatrix4 {
+	SceFVector4 x;
+	SceFVector4 y;
+	SceFVector4 z;
+	SceFVector4 w;
+} SceUMatrix4;
+
+typedef struct SceMotionState {
+	unsigned int timestamp;
+	SceFVector3 acceleration;
+	SceFVector3 angularVelocity;
+	uint8_t reserve1[12];
+	SceFQuaternion deviceQuat;
+	SceUMatrix4 rotationMatrix;
+	SceUMatrix4 nedMatrix;
+	uint8_t reserve2[4];
+	SceFVector3 basicOrientation;
+	SceUInt64 hostTimestamp;
+	uint8_t reserve3[40];
+} SceMotionState;
+
+/* Shim control interface, not part of the kernel API */
+
+enum shim_call {
+	SHIM_CALL_BT_READ_EVENT,
+	SHIM_CALL_BT_HID_TRANSFER,
+	SHIM_CALL_BT_GET_VID_PID,
+	SHIM_CALL_BT_CONNECT,
+	SHIM_CALL_BT_DISCONNECT,
+	SHIM_CALL_BT_INQUIRY,
+	SHIM_CALL_CTRL_SET_BUTTON_EMULATION,
+	SHIM_CALL_CTRL_SET_ANALOG_EMULATION,
+	SHIM_CALL_POWER_TICK,
+	SHIM_CALL_MEMCPY_USER_TO_KERNEL,
+	SHIM_CALL_MEMCPY_KERNEL_TO_USER,
+	SHIM_CALL_HEAP_ALLOC,
+	SHIM_CALL_HEAP_FREE,
+	SHIM_CALL_HOOK,
+	SHIM_CALL_HOOK_RELEASE,
+	SHIM_CALL_IO,
+	SHIM_CALL_MAX
+};
+
+struct shim_emulation {
+	unsigned int buttons;
+	unsigned char lx, ly, rx, ry;
+};
+
+unsigned long shim_call_count(enum shim_call call);
+void shim_reset_counts(void);
+const char *shim_call_name(enum shim_call call);
+void shim_get_emulation(struct shim_emulation *emu);
+
+/* Freezes ksceKernelGetSystemTimeWide() at usec, -1 goes back to the host clock */
+void shim_set_time(SceInt64 usec);
+
+void shim_bt_set_vid_pid(unsigned short vid, unsigned short pid);
+/* What a feature report read (a type 2 transfer) returns */
+void shim_bt_set_feature(const void *data, size_t size);
+void shim_bt_push_event(unsigned char id, unsigned int mac0, unsigned int mac1);
+int shim_bt_push_report(unsigned int mac0, unsigned int mac1,
+	const void *data, unsigned int length);
+int shim_bt_notify(void);
+size_t shim_bt_last_output(void *data, size_t size);
+
+/* Calls the registered sysevent handler like a suspend (0) or a resume (1) */
+void shim_sysevent(int resume);
+
+const void *shim_find_export_hook(uint32_t func_nid);
+
+#endif
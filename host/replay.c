@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "shim.h"
+#include "capture.h"
+#include "ds5vita.h"
+#include "predict.h"
+#include "report.h"
+
+/*
+ * Feeds a trace written by the capture mode back through bt_cb_func.
+ * By default as fast as possible on the trace's virtual clock, with
+ * --realtime at the original pace. --predict also scores the stick and
+ * trigger extrapolation against the reports that actually came next.
+ */
+
+extern int module_start(SceSize argc, const void *args);
+extern int module_stop(SceSize argc, const void *args);
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [--realtime] [--predict] [--loop n] trace.bin\n", argv0);
+	exit(2);
+}
+
+/* Axes of port 1 after each report, as a game would get them */
+struct track_sample {
+	unsigned long long t;
+	unsigned char axis[DS5_AXIS_COUNT];
+};
+
+struct replay {
+	unsigned long long t;        /* trace time of the current record, us */
+	unsigned long long t0;       /* trace time of the first record */
+	unsigned long long wall0;    /* host time it was replayed at, ns */
+	int realtime;
+	unsigned int mac0, mac1;
+	int pending_report;
+
+	unsigned long events, reports, dropped;
+	unsigned long long report_ns;
+
+	int predict;
+	struct track_sample *track;
+	unsigned int track_len, track_size, seq;
+};
+
+static void track_report(struct replay *r)
+{
+	struct ds5vita_state state;
+	struct track_sample *t;
+
+	if (ds5vitaGetState(1, &state, sizeof(state), r->seq) != 1)
+		return;
+	r->seq = state.seq;
+
+	if (r->track_len == r->track_size) {
+		r->track_size = r->track_size ? r->track_size * 2 : 4096;
+		r->track = realloc(r->track, r->track_size * sizeof(*r->track));
+	}
+
+	t = &r->track[r->track_len++];
+	t->t = state.timestamp;
+	t->axis[DS5_AXIS_LX] = state.lx;
+	t->axis[DS5_AXIS_LY] = state.ly;
+	t->axis[DS5_AXIS_RX] = state.rx;
+	t->axis[DS5_AXIS_RY] = state.ry;
+	t->axis[DS5_AXIS_LT] = state.lt;
+	t->axis[DS5_AXIS_RT] = state.rt;
+}
+
+/*
+ * For each report and lead time, compares holding the report and
+ * extrapolating it against the axes linearly interpolated between the
+ * reports around that time. Only axis samples that moved meanwhile count.
+ */
+static void score_prediction(const struct track_sample *track, unsigned int n)
+{
+	static const unsigned int ahead_ms[] = { 1, 2, 4, 8, 12, 16 };
+	unsigned int a, k, j, axis;
+
+	printf("prediction, mean abs error in units over moving axes:\n");
+
+	for (a = 0; a < sizeof(ahead_ms) / sizeof(*ahead_ms); a++) {
+		unsigned int ahead = ahead_ms[a] * 1000;
+		unsigned long long hold_err = 0, predict_err = 0;
+		unsigned long count = 0, worse = 0;
+
+		for (k = 2, j = 3; k < n; k++) {
+			unsigned long long t = track[k].t + ahead;
+			unsigned char out[DS5_AXIS_COUNT];
+
+			while (j < n && track[j].t < t)
+				j++;
+			if (j >= n)
+				break;
+
+			memcpy(out, track[k].axis, sizeof(out));
+			ds5_predict(track[k - 2].axis, track[k - 1].axis, track[k].axis,
+				track[k].t - track[k - 1].t, ahead, out);
+
+			for (axis = 0; axis < 6; axis++) {
+				const struct track_sample *s0 = &track[j - 1], *s1 = &track[j];
+				long long span = s1->t - s0->t;
+				int truth, e_hold, e_pred;
+
+				truth = s0->axis[axis];
+				if (span > 0)
+					truth += ((int)s1->axis[axis] - s0->axis[axis]) *
+						(long long)(t - s0->t) / span;
+
+				e_hold = abs(truth - track[k].axis[axis]);
+				e_pred = abs(truth - out[axis]);
+				if (e_hold == 0 && e_pred == 0)
+					continue;
+
+				hold_err += e_hold;
+				predict_err += e_pred;
+				worse += e_pred > e_hold;
+				count++;
+			}
+		}
+
+		if (count)
+			printf("  %2u ms ahead: hold %.2f, predict %.2f, worse in %.1f%% of %lu\n",
+				ahead_ms[a], (double)hold_err / count, (double)predict_err / count,
+				100.0 * worse / count, count);
+	}
+}
+
+static void pace(struct replay *r)
+{
+	long long ahead;
+
+	shim_set_time(r->t);
+
+	if (!r->realtime)
+		return;
+
+	ahead = (long long)(r->t - r->t0) * 1000 - (long long)(now_ns() - r->wall0);
+	if (ahead > 0)
+		usleep(ahead / 1000);
+}
+
+static void replay_record(struct replay *r, const struct ds5_trace_record *rec,
+			  const unsigned char *payload)
+{
+	switch (rec->type) {
+	case DS5_TRACE_EVENT: {
+		const SceBtEvent *ev = (const SceBtEvent *)payload;
+
+		r->mac0 = ev->mac0;
+		r->mac1 = ev->mac1;
+		r->events++;
+
+		/* The shim raises 0x0A with the report and 0x0B on each output itself */
+		if (ev->id == 0x0A) {
+			r->pending_report = 1;
+		} else if (ev->id != 0x0B) {
+			pace(r);
+			shim_bt_push_event(ev->id, ev->mac0, ev->mac1);
+			shim_bt_notify();
+		}
+		break;
+	}
+
+	case DS5_TRACE_REPORT: {
+		unsigned long long start;
+
+		if (!r->pending_report)
+			break;
+		r->pending_report = 0;
+
+		pace(r);
+		start = now_ns();
+		if (shim_bt_push_report(r->mac0, r->mac1, payload, rec->length) < 0) {
+			fprintf(stderr, "report at +%llu us: no read request armed\n",
+				r->t - r->t0);
+			break;
+		}
+		shim_bt_notify();
+		r->report_ns += now_ns() - start;
+		r->reports++;
+
+		if (r->predict)
+			track_report(r);
+		break;
+	}
+
+	case DS5_TRACE_VID_PID: {
+		unsigned int vid_pid;
+
+		memcpy(&vid_pid, payload + 8, sizeof(vid_pid));
+		shim_bt_set_vid_pid(vid_pid & 0xFFFF, vid_pid >> 16);
+		break;
+	}
+
+	case DS5_TRACE_DROPPED: {
+		unsigned int count;
+
+		memcpy(&count, payload, sizeof(count));
+		r->dropped += count;
+		break;
+	}
+	}
+}
+
+/* The whole trace is loaded up front, so no file I/O shows in the timings */
+static unsigned char *load_trace(const char *path, size_t *size)
+{
+	unsigned char *data;
+	FILE *f = fopen(path, "rb");
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	data = malloc(*size);
+	if (data && fread(data, 1, *size, f) != *size) {
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+
+	return data;
+}
+
+static int replay_trace(struct replay *r, const unsigned char *data, size_t size)
+{
+	struct ds5_trace_header header;
+	struct ds5_trace_record rec;
+	size_t pos;
+
+	if (size < sizeof(header))
+		goto error_format;
+
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != DS5_TRACE_MAGIC || header.version != DS5_TRACE_VERSION ||
+	    header.size < sizeof(header) || header.size > size)
+		goto error_format;
+
+	/* Later loops carry on after the previous one, the clock never goes back */
+	if (r->t0 == 0) {
+		r->t = r->t0 = header.start;
+		r->wall0 = now_ns();
+	}
+
+	for (pos = header.size; pos + sizeof(rec) <= size; pos += sizeof(rec) + rec.length) {
+		memcpy(&rec, data + pos, sizeof(rec));
+		if (pos + sizeof(rec) + rec.length > size) {
+			fprintf(stderr, "truncated record at +%llu us\n", r->t - r->t0);
+			break;
+		}
+
+		r->t += rec.delta;
+		replay_record(r, &rec, data + pos + sizeof(rec));
+	}
+
+	return 0;
+
+error_format:
+	fprintf(stderr, "not a ds5vita trace\n");
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct replay r;
+	struct ds5vita_link_stats link;
+	unsigned int loops = 1, i;
+	const char *path = NULL;
+	unsigned char *data;
+	size_t size;
+	int arg;
+
+	memset(&r, 0, sizeof(r));
+
+	for (arg = 1; arg < argc; arg++) {
+		if (!strcmp(argv[arg], "--realtime"))
+			r.realtime = 1;
+		else if (!strcmp(argv[arg], "--predict"))
+			r.predict = 1;
+		else if (!strcmp(argv[arg], "--loop") && arg + 1 < argc)
+			loops = strtoul(argv[++arg], NULL, 0);
+		else if (argv[arg][0] == '-' || path)
+			usage(argv[0]);
+		else
+			path = argv[arg];
+	}
+
+	if (!path)
+		usage(argv[0]);
+
+	data = load_trace(path, &size);
+	if (!data)
+		return 1;
+
+	module_start(0, NULL);
+	shim_reset_counts();
+
+	for (i = 0; i < loops; i++) {
+		if (replay_trace(&r, data, size) < 0)
+			return 1;
+	}
+
+	printf("%lu events, %lu reports, %lu dropped at capture time\n",
+		r.events, r.reports, r.dropped);
+	if (r.reports)
+		printf("bt_cb_func: %.1f ns/report\n", (double)r.report_ns / r.reports);
+
+	ds5vitaGetLinkStats(1, &link, sizeof(link));
+	printf("link: %u received, %u lost in %u gaps, %u duplicates, %u out of order\n",
+		link.received, link.lost, link.gaps, link.duplicates, link.out_of_order);
+	printf("link: %u us mean interval, %u us jitter, %u us max\n",
+		link.interval, link.jitter, link.interval_max);
+
+	for (i = 0; i < SHIM_CALL_MAX; i++) {
+		unsigned long count = shim_call_count(i);
+		if (count)
+			printf("  %-32s %lu\n", shim_call_name(i), count);
+	}
+
+	if (r.predict)
+		score_prediction(r.track, r.track_len);
+
+	module_stop(0, NULL);
+	free(r.track);
+	free(data);
+
+	return 0;
+}
@@ -0,0 +1,739 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "shim.h"
+
+#define SHIM_MAX_THREADS 8
+#define SHIM_MAX_HOOKS   32
+#define SHIM_EVENT_QUEUE 64
+#define SHIM_MAX_EVFS    8
+#define SHIM_MAX_LINKS   8
+#define SHIM_MAX_READS   8
+
+static unsigned long call_counts[SHIM_CALL_MAX];
+
+static const char *call_names[SHIM_CALL_MAX] = {
+	[SHIM_CALL_BT_READ_EVENT]             = "ksceBtReadEvent",
+	[SHIM_CALL_BT_HID_TRANSFER]           = "ksceBtHidTransfer",
+	[SHIM_CALL_BT_GET_VID_PID]            = "ksceBtGetVidPid",
+	[SHIM_CALL_BT_CONNECT]                = "ksceBtStartConnect",
+	[SHIM_CALL_BT_DISCONNECT]             = "ksceBtStartDisconnect",
+	[SHIM_CALL_BT_INQUIRY]                = "ksceBtStart/StopInquiry",
+	[SHIM_CALL_CTRL_SET_BUTTON_EMULATION] = "ksceCtrlSetButtonEmulation",
+	[SHIM_CALL_CTRL_SET_ANALOG_EMULATION] = "ksceCtrlSetAnalogEmulation",
+	[SHIM_CALL_POWER_TICK]                = "ksceKernelPowerTick",
+	[SHIM_CALL_MEMCPY_USER_TO_KERNEL]     = "ksceKernelMemcpyUserToKernel",
+	[SHIM_CALL_MEMCPY_KERNEL_TO_USER]     = "ksceKernelMemcpyKernelToUser",
+	[SHIM_CALL_HEAP_ALLOC]                = "ksceKernelAllocHeapMemory",
+	[SHIM_CALL_HEAP_FREE]                 = "ksceKernelFreeHeapMemory",
+	[SHIM_CALL_HOOK]                      = "taiHookFunction*ForKernel",
+	[SHIM_CALL_HOOK_RELEASE]              = "taiHookReleaseForKernel",
+	[SHIM_CALL_IO]                        = "ksceIo*",
+};
+
+#define COUNT(call) __sync_fetch_and_add(&call_counts[call], 1)
+
+unsigned long shim_call_count(enum shim_call call)
+{
+	return call_counts[call];
+}
+
+void shim_reset_counts(void)
+{
+	memset(call_counts, 0, sizeof(call_counts));
+}
+
+const char *shim_call_name(enum shim_call call)
+{
+	return call_names[call];
+}
+
+/* taiHEN */
+
+struct shim_hook {
+	uint32_t func_nid;
+	const void *func;
+	tai_hook_ref_t *ref;
+};
+
+static struct shim_hook hooks[SHIM_MAX_HOOKS];
+static int num_hooks;
+
+static int shim_original()
+{
+	return 0;
+}
+
+int taiGetModuleInfoForKernel(SceUID pid, const char *module, tai_module_info_t *info)
+{
+	info->modid = 1;
+	strncpy(info->name, module, sizeof(info->name) - 1);
+	return 0;
+}
+
+static SceUID add_hook(tai_hook_ref_t *p_hook, uint32_t func_nid, const void *hook_func)
+{
+	int i;
+
+	COUNT(SHIM_CALL_HOOK);
+
+	/* Reuse released slots, the input hooks come and go with the controllers */
+	for (i = 0; i < num_hooks && hooks[i].func; i++)
+		;
+	if (i >= SHIM_MAX_HOOKS)
+		return -1;
+	if (i == num_hooks)
+		num_hooks++;
+
+	*p_hook = (tai_hook_ref_t)shim_original;
+	hooks[i].func_nid = func_nid;
+	hooks[i].func = hook_func;
+	hooks[i].ref = p_hook;
+
+	return i + 1;
+}
+
+SceUID taiHookFunctionExportForKernel(SceUID pid, tai_hook_ref_t *p_hook,
+	const char *module, uint32_t library_nid, uint32_t func_nid, const void *hook_func)
+{
+	return add_hook(p_hook, func_nid, hook_func);
+}
+
+SceUID taiHookFunctionOffsetForKernel(SceUID pid, tai_hook_ref_t *p_hook,
+	SceUID modid, int segidx, uint32_t offset, int thumb, const void *hook_func)
+{
+	return add_hook(p_hook, offset, hook_func);
+}
+
+int taiHookReleaseForKernel(SceUID tai_uid, tai_hook_ref_t hook)
+{
+	COUNT(SHIM_CALL_HOOK_RELEASE);
+
+	if (tai_uid <= 0 || tai_uid > num_hooks)
+		return -1;
+
+	hooks[tai_uid - 1].func = NULL;
+	return 0;
+}
+
+const void *shim_find_export_hook(uint32_t func_nid)
+{
+	int i;
+
+	for (i = 0; i < num_hooks; i++) {
+		if (hooks[i].func && hooks[i].func_nid == func_nid)
+			return hooks[i].func;
+	}
+
+	return NULL;
+}
+
+/* threadmgr */
+
+struct shim_thread {
+	pthread_t handle;
+	SceKernelThreadEntry entry;
+	SceSize arglen;
+	void *argp;
+};
+
+static struct shim_thread threads[SHIM_MAX_THREADS];
+static int num_threads;
+
+static SceKernelCallbackFunction callback_func;
+static void *callback_arg;
+static volatile SceUID bt_callback;
+
+static void *thread_main(void *arg)
+{
+	struct shim_thread *th = arg;
+
+	th->entry(th->arglen, th->argp);
+	return NULL;
+}
+
+SceUID ksceKernelCreateThread(const char *name, SceKernelThreadEntry entry,
+	int initPriority, SceSize stackSize, SceUInt attr, int cpuAffinityMask,
+	const void *option)
+{
+	if (num_threads >= SHIM_MAX_THREADS)
+		return -1;
+
+	threads[num_threads].entry = entry;
+	return ++num_threads;
+}
+
+int ksceKernelStartThread(SceUID thid, SceSize arglen, void *argp)
+{
+	struct shim_thread *th = &threads[thid - 1];
+
+	th->arglen = arglen;
+	th->argp = argp;
+	return pthread_create(&th->handle, NULL, thread_main, th);
+}
+
+int ksceKernelWaitThreadEnd(SceUID thid, int *stat, SceUInt *timeout)
+{
+	struct timespec deadline;
+
+	if (!timeout)
+		return pthread_join(threads[thid - 1].handle, NULL);
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += *timeout / 1000000;
+	deadline.tv_nsec += (*timeout % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	if (pthread_timedjoin_np(threads[thid - 1].handle, NULL, &deadline))
+		return SCE_KERNEL_ERROR_WAIT_TIMEOUT;
+	return 0;
+}
+
+int ksceKernelDeleteThread(SceUID thid)
+{
+	return 0;
+}
+
+int ksceKernelDelayThread(SceUInt delay)
+{
+	return usleep(delay);
+}
+
+int ksceKernelDelayThreadCB(SceUInt delay)
+{
+	/*
+	 * Notifications are delivered synchronously by shim_bt_notify()
+	 * on the caller's thread, so there is nothing to service here.
+	 */
+	return usleep(delay);
+}
+
+SceUID ksceKernelCreateCallback(const char *name, unsigned int attr,
+	SceKernelCallbackFunction func, void *arg)
+{
+	callback_func = func;
+	callback_arg = arg;
+	return 1;
+}
+
+int ksceKernelDeleteCallback(SceUID cb)
+{
+	callback_func = NULL;
+	return 0;
+}
+
+struct shim_evf {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int bits;
+	int used;
+};
+
+static struct shim_evf evfs[SHIM_MAX_EVFS];
+
+SceUID ksceKernelCreateEventFlag(const char *name, int attr, int bits,
+	SceKernelEventFlagOptParam *opt)
+{
+	int i;
+
+	for (i = 0; i < SHIM_MAX_EVFS; i++) {
+		if (!__sync_bool_compare_and_swap(&evfs[i].used, 0, 1))
+			continue;
+
+		pthread_mutex_init(&evfs[i].lock, NULL);
+		pthread_cond_init(&evfs[i].cond, NULL);
+		evfs[i].bits = bits;
+		return i + 1;
+	}
+
+	return -1;
+}
+
+int ksceKernelDeleteEventFlag(SceUID evfId)
+{
+	struct shim_evf *evf = &evfs[evfId - 1];
+
+	pthread_cond_destroy(&evf->cond);
+	pthread_mutex_destroy(&evf->lock);
+	evf->used = 0;
+	return 0;
+}
+
+int ksceKernelSetEventFlag(SceUID evfId, unsigned int bits)
+{
+	struct shim_evf *evf = &evfs[evfId - 1];
+
+	pthread_mutex_lock(&evf->lock);
+	evf->bits |= bits;
+	pthread_cond_broadcast(&evf->cond);
+	pthread_mutex_unlock(&evf->lock);
+	return 0;
+}
+
+int ksceKernelClearEventFlag(SceUID evfId, unsigned int bits)
+{
+	struct shim_evf *evf = &evfs[evfId - 1];
+
+	/* Like the kernel, bits is the pattern to keep */
+	pthread_mutex_lock(&evf->lock);
+	evf->bits &= bits;
+	pthread_mutex_unlock(&evf->lock);
+	return 0;
+}
+
+static int evf_matches(unsigned int cur, unsigned int bits, unsigned int wait)
+{
+	if (wait & SCE_EVENT_WAITOR)
+		return (cur & bits) != 0;
+	return (cur & bits) == bits;
+}
+
+int ksceKernelWaitEventFlag(SceUID evfId, unsigned int bits, unsigned int wait,
+	unsigned int *outBits, SceUInt *timeout)
+{
+	struct shim_evf *evf = &evfs[evfId - 1];
+	struct timespec deadline;
+	int ret = 0;
+
+	if (timeout) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += *timeout / 1000000;
+		deadline.tv_nsec += (*timeout % 1000000) * 1000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&evf->lock);
+	while (!evf_matches(evf->bits, bits, wait)) {
+		if (!timeout) {
+			pthread_cond_wait(&evf->cond, &evf->lock);
+		} else if (pthread_cond_timedwait(&evf->cond, &evf->lock, &deadline)) {
+			ret = SCE_KERNEL_ERROR_WAIT_TIMEOUT;
+			break;
+		}
+	}
+
+	if (outBits)
+		*outBits = evf->bits;
+	if (ret == 0) {
+		if (wait & SCE_EVENT_WAITCLEAR)
+			evf->bits = 0;
+		else if (wait & SCE_EVENT_WAITCLEAR_PAT)
+			evf->bits &= ~bits;
+	}
+	pthread_mutex_unlock(&evf->lock);
+
+	if (timeout)
+		*timeout = 0;
+	return ret;
+}
+
+int ksceKernelWaitEventFlagCB(SceUID evfId, unsigned int bits, unsigned int wait,
+	unsigned int *outBits, SceUInt *timeout)
+{
+	/* Callbacks are delivered by shim_bt_notify(), see ksceKernelDelayThreadCB() */
+	return ksceKernelWaitEventFlag(evfId, bits, wait, outBits, timeout);
+}
+
+static SceInt64 virtual_time = -1;
+
+void shim_set_time(SceInt64 usec)
+{
+	virtual_time = usec;
+}
+
+SceInt64 ksceKernelGetSystemTimeWide(void)
+{
+	struct timespec ts;
+
+	if (virtual_time >= 0)
+		return virtual_time;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (SceInt64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* sysmem */
+
+SceUID ksceKernelCreateHeap(const char *name, SceSize size, SceKernelHeapCreateOpt *opt)
+{
+	return 1;
+}
+
+int ksceKernelDeleteHeap(SceUID uid)
+{
+	return 0;
+}
+
+void *ksceKernelAllocHeapMemory(SceUID uid, SceSize size)
+{
+	COUNT(SHIM_CALL_HEAP_ALLOC);
+	return malloc(size);
+}
+
+void ksceKernelFreeHeapMemory(SceUID uid, void *ptr)
+{
+	COUNT(SHIM_CALL_HEAP_FREE);
+	free(ptr);
+}
+
+int ksceKernelMemcpyUserToKernel(void *dst, uintptr_t src, SceSize len)
+{
+	COUNT(SHIM_CALL_MEMCPY_USER_TO_KERNEL);
+	memcpy(dst, (const void *)src, len);
+	return 0;
+}
+
+int ksceKernelMemcpyKernelToUser(uintptr_t dst, const void *src, SceSize len)
+{
+	COUNT(SHIM_CALL_MEMCPY_KERNEL_TO_USER);
+	memcpy((void *)dst, src, len);
+	return 0;
+}
+
+/* suspend */
+
+int ksceKernelPowerTick(int type)
+{
+	COUNT(SHIM_CALL_POWER_TICK);
+	return 0;
+}
+
+static SceSysEventHandler sysevent_handler;
+static void *sysevent_args;
+
+SceUID ksceKernelRegisterSysEventHandler(const char *name, SceSysEventHandler handler,
+	void *args)
+{
+	sysevent_handler = handler;
+	sysevent_args = args;
+	return 1;
+}
+
+void ksceKernelUnregisterSysEventHandler(SceUID id)
+{
+	sysevent_handler = NULL;
+}
+
+void shim_sysevent(int resume)
+{
+	if (sysevent_handler)
+		sysevent_handler(resume, resume ? 0x100000 : 0x4, sysevent_args, NULL);
+}
+
+/* io: "ux0:dir/file" maps to "./ux0/dir/file" relative to the cwd */
+
+static void host_path(char *out, size_t size, const char *path)
+{
+	const char *colon = strchr(path, ':');
+
+	if (colon)
+		snprintf(out, size, "%.*s/%s", (int)(colon - path), path, colon + 1);
+	else
+		snprintf(out, size, "%s", path);
+}
+
+SceUID ksceIoOpen(const char *file, int flags, int mode)
+{
+	char path[256];
+	int hflags = 0;
+
+	COUNT(SHIM_CALL_IO);
+	host_path(path, sizeof(path), file);
+
+	if ((flags & SCE_O_RDWR) == SCE_O_RDWR)
+		hflags |= O_RDWR;
+	else if (flags & SCE_O_WRONLY)
+		hflags |= O_WRONLY;
+	else
+		hflags |= O_RDONLY;
+	if (flags & SCE_O_APPEND)
+		hflags |= O_APPEND;
+	if (flags & SCE_O_CREAT)
+		hflags |= O_CREAT;
+	if (flags & SCE_O_TRUNC)
+		hflags |= O_TRUNC;
+
+	return open(path, hflags, 0644);
+}
+
+int ksceIoClose(SceUID fd)
+{
+	COUNT(SHIM_CALL_IO);
+	return close(fd);
+}
+
+int ksceIoRead(SceUID fd, void *data, SceSize size)
+{
+	COUNT(SHIM_CALL_IO);
+	return read(fd, data, size);
+}
+
+int ksceIoWrite(SceUID fd, const void *data, SceSize size)
+{
+	COUNT(SHIM_CALL_IO);
+	return write(fd, data, size);
+}
+
+int ksceIoMkdir(const char *dir, int mode)
+{
+	char path[256];
+	char *sep;
+
+	COUNT(SHIM_CALL_IO);
+	host_path(path, sizeof(path), dir);
+
+	for (sep = strchr(path, '/'); sep; sep = strchr(sep + 1, '/')) {
+		*sep = '\0';
+		mkdir(path, 0755);
+		*sep = '/';
+	}
+
+	return mkdir(path, 0755);
+}
+
+/* bt */
+
+static pthread_mutex_t bt_lock = PTHREAD_MUTEX_INITIALIZER;
+static SceBtEvent event_queue[SHIM_EVENT_QUEUE];
+static unsigned int event_head, event_tail;
+/* The read requests each connected controller has armed, oldest first */
+static struct {
+	unsigned int mac0, mac1;
+	SceBtHidRequest *read[SHIM_MAX_READS];
+	unsigned int head, tail;
+} links[SHIM_MAX_LINKS];
+
+/* A link is free while it has no read armed */
+static int find_link(unsigned int mac0, unsigned int mac1, int create)
+{
+	int i, free = -1;
+
+	for (i = 0; i < SHIM_MAX_LINKS; i++) {
+		int armed = links[i].head != links[i].tail;
+
+		if (armed && links[i].mac0 == mac0 && links[i].mac1 == mac1)
+			return i;
+		if (!armed && free < 0)
+			free = i;
+	}
+
+	if (!create || free < 0)
+		return -1;
+
+	links[free].mac0 = mac0;
+	links[free].mac1 = mac1;
+	return free;
+}
+
+static unsigned char last_output[0x100];
+static size_t last_output_len;
+static unsigned short bt_vid_pid[2] = { 0x054C, 0x05C4 };
+static unsigned char feature[0x100];
+static size_t feature_len;
+
+static void queue_event(unsigned char id, unsigned int mac0, unsigned int mac1)
+{
+	SceBtEvent *ev;
+
+	if (event_head - event_tail >= SHIM_EVENT_QUEUE)
+		return;
+
+	ev = &event_queue[event_head++ % SHIM_EVENT_QUEUE];
+	memset(ev, 0, sizeof(*ev));
+	ev->id = id;
+	ev->mac0 = mac0;
+	ev->mac1 = mac1;
+}
+
+int ksceBtReadEvent(SceBtEvent *events, int num_events)
+{
+	int n = 0;
+
+	COUNT(SHIM_CALL_BT_READ_EVENT);
+
+	pthread_mutex_lock(&bt_lock);
+	while (n < num_events && event_tail != event_head)
+		events[n++] = event_queue[event_tail++ % SHIM_EVENT_QUEUE];
+	pthread_mutex_unlock(&bt_lock);
+
+	return n;
+}
+
+int ksceBtHidTransfer(unsigned int mac0, unsigned int mac1, SceBtHidRequest *request)
+{
+	COUNT(SHIM_CALL_BT_HID_TRANSFER);
+
+	pthread_mutex_lock(&bt_lock);
+	if (request->type == 0) {
+		int link = find_link(mac0, mac1, 1);
+		if (link >= 0 && links[link].head - links[link].tail < SHIM_MAX_READS)
+			links[link].read[links[link].head++ % SHIM_MAX_READS] = request;
+	} else if (request->type == 2) {
+		/* Feature reads answer at once, with whatever was set */
+		memcpy(request->buffer, feature,
+			feature_len < request->length ? feature_len : request->length);
+		queue_event(0x0C, mac0, mac1);
+	} else {
+		last_output_len = request->length < sizeof(last_output) ?
+			request->length : sizeof(last_output);
+		memcpy(last_output, request->buffer, last_output_len);
+		queue_event(0x0B, mac0, mac1);
+	}
+	pthread_mutex_unlock(&bt_lock);
+
+	return 0;
+}
+
+int ksceBtGetVidPid(unsigned int mac0, unsigned int mac1, unsigned short vid_pid[2])
+{
+	COUNT(SHIM_CALL_BT_GET_VID_PID);
+	vid_pid[0] = bt_vid_pid[0];
+	vid_pid[1] = bt_vid_pid[1];
+	return 0;
+}
+
+int ksceBtStartInquiry(void)
+{
+	COUNT(SHIM_CALL_BT_INQUIRY);
+	return 0;
+}
+
+int ksceBtStopInquiry(void)
+{
+	COUNT(SHIM_CALL_BT_INQUIRY);
+	return 0;
+}
+
+int ksceBtStartConnect(unsigned int mac0, unsigned int mac1)
+{
+	COUNT(SHIM_CALL_BT_CONNECT);
+	return 0;
+}
+
+int ksceBtStartDisconnect(unsigned int mac0, unsigned int mac1)
+{
+	COUNT(SHIM_CALL_BT_DISCONNECT);
+	return 0;
+}
+
+int ksceBtReplyUserConfirmation(unsigned int mac0, unsigned int mac1, int unk)
+{
+	return 0;
+}
+
+int ksceBtRegisterCallback(SceUID cb, int unused, int flags1, int flags2)
+{
+	bt_callback = cb;
+	return 0;
+}
+
+int ksceBtUnregisterCallback(SceUID cb)
+{
+	bt_callback = 0;
+	return 0;
+}
+
+void shim_bt_set_vid_pid(unsigned short vid, unsigned short pid)
+{
+	bt_vid_pid[0] = vid;
+	bt_vid_pid[1] = pid;
+}
+
+void shim_bt_set_feature(const void *data, size_t size)
+{
+	pthread_mutex_lock(&bt_lock);
+	feature_len = size < sizeof(feature) ? size : sizeof(feature);
+	memcpy(feature, data, feature_len);
+	pthread_mutex_unlock(&bt_lock);
+}
+
+void shim_bt_push_event(unsigned char id, unsigned int mac0, unsigned int mac1)
+{
+	pthread_mutex_lock(&bt_lock);
+	queue_event(id, mac0, mac1);
+	pthread_mutex_unlock(&bt_lock);
+}
+
+int shim_bt_push_report(unsigned int mac0, unsigned int mac1,
+	const void *data, unsigned int length)
+{
+	SceBtHidRequest *req = NULL;
+	int link;
+
+	pthread_mutex_lock(&bt_lock);
+	link = find_link(mac0, mac1, 0);
+	if (link >= 0)
+		req = links[link].read[links[link].tail++ % SHIM_MAX_READS];
+	if (req) {
+		if (length > req->length)
+			length = req->length;
+		memcpy(req->buffer, data, length);
+		queue_event(0x0A, mac0, mac1);
+	}
+	pthread_mutex_unlock(&bt_lock);
+
+	return req ? 0 : -1;
+}
+
+int shim_bt_notify(void)
+{
+	/* Wait for the module's BT thread to register its callback */
+	while (!bt_callback)
+		usleep(1000);
+
+	return callback_func(bt_callback, 1, 0, callback_arg);
+}
+
+size_t shim_bt_last_output(void *data, size_t size)
+{
+	size_t len;
+
+	pthread_mutex_lock(&bt_lock);
+	len = last_output_len < size ? last_output_len : size;
+	memcpy(data, last_output, len);
+	pthread_mutex_unlock(&bt_lock);
+
+	return len;
+}
+
+/* ctrl */
+
+static struct shim_emulation emulation;
+
+int ksceCtrlSetButtonEmulation(unsigned int port, unsigned char slot,
+	unsigned int userButtons, unsigned int kernelButtons, unsigned int uiMake)
+{
+	COUNT(SHIM_CALL_CTRL_SET_BUTTON_EMULATION);
+	emulation.buttons = userButtons;
+	return 0;
+}
+
+int ksceCtrlSetAnalogEmulation(unsigned int port, unsigned char slot,
+	unsigned char user_lX, unsigned char user_lY,
+	unsigned char user_rX, unsigned char user_rY,
+	unsigned char kernel_lX, unsigned char kernel_lY,
+	unsigned char kernel_rX, unsigned char kernel_rY, unsigned int uiMake)
+{
+	COUNT(SHIM_CALL_CTRL_SET_ANALOG_EMULATION);
+	emulation.lx = user_lX;
+	emulation.ly = user_lY;
+	emulation.rx = user_rX;
+	emulation.ry = user_rY;
+	return 0;
+}
+
+void shim_get_emulation(struct shim_emulation *emu)
+{
+	*emu = emulation;
+}
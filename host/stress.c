@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "state.h"
+
+/*
+ * One writer pushes states whose every field derives from a counter while
+ * readers take the oldest sample, the one about to be overwritten, and
+ * check it is whole. --no-retry copies the ring slot directly, without the
+ * sequence check, to show the checker catches torn reads at all.
+ */
+
+#define READERS 2
+
+static struct ds5_history history;
+static volatile int done;
+static int no_retry;
+
+static void make_state(struct ds5_state *state, unsigned int i)
+{
+	unsigned int k;
+
+	memset(state, 0, sizeof(*state));
+	state->buttons = i;
+	state->lx = i;
+	state->ly = i >> 8;
+	state->rx = ~i;
+	state->ry = i * 3;
+	state->lt = i * 5;
+	state->rt = i * 7;
+	state->sticks = i * 11;
+	state->sticks_mask = i * 13;
+	state->battery_level = i & 0x0F;
+	state->seq = i * 17;
+
+	for (k = 0; k < 3; k++) {
+		state->accel[k] = i + k;
+		state->gyro[k] = i - k;
+	}
+
+	for (k = 0; k < 2; k++) {
+		state->finger[k].id = i + k;
+		state->finger[k].x = i * 19 + k;
+		state->finger[k].y = i * 23 + k;
+	}
+}
+
+static void *writer(void *arg)
+{
+	unsigned int n = *(unsigned int *)arg, i;
+	struct ds5_state state;
+
+	for (i = 1; i <= n; i++) {
+		make_state(&state, i);
+		ds5_history_push(&history, i, &state);
+	}
+
+	done = 1;
+	return NULL;
+}
+
+static int read_oldest(struct ds5_state *state)
+{
+	unsigned int head = ds5_history_head(&history);
+	unsigned int index = head - DS5_HISTORY_SIZE;
+	const struct ds5_history_entry *entry;
+	struct ds5_sample sample;
+
+	if (head < DS5_HISTORY_SIZE)
+		return -1;
+
+	if (!no_retry) {
+		if (ds5_history_get(&history, index, &sample) < 0)
+			return -1;
+		memcpy(state, &sample.state, sizeof(*state));
+		return 0;
+	}
+
+	entry = &history.entry[index & (DS5_HISTORY_SIZE - 1)];
+	memcpy(state, (const void *)&entry->sample.state, sizeof(*state));
+	return 0;
+}
+
+static void *reader(void *arg)
+{
+	unsigned long *torn = arg, reads = 0;
+	struct ds5_state state, expected;
+
+	while (!done) {
+		if (read_oldest(&state) < 0)
+			continue;
+
+		make_state(&expected, state.buttons);
+		if (memcmp(&state, &expected, sizeof(state)) != 0)
+			(*torn)++;
+		reads++;
+	}
+
+	torn[1] = reads;
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int n = 20000000;
+	unsigned long result[READERS][2];
+	unsigned long torn = 0, reads = 0;
+	pthread_t threads[READERS + 1];
+	int arg, i;
+
+	for (arg = 1; arg < argc; arg++) {
+		if (!strcmp(argv[arg], "--no-retry"))
+			no_retry = 1;
+		else
+			n = strtoul(argv[arg], NULL, 0);
+	}
+
+	memset(result, 0, sizeof(result));
+	for (i = 0; i < READERS; i++)
+		pthread_create(&threads[i], NULL, reader, result[i]);
+	pthread_create(&threads[READERS], NULL, writer, &n);
+
+	for (i = 0; i <= READERS; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; i < READERS; i++) {
+		torn += result[i][0];
+		reads += result[i][1];
+	}
+
+	printf("%u writes, %lu reads%s, %lu torn\n", n, reads,
+		no_retry ? " without retry" : "", torn);
+
+	return torn && !no_retry;
+}
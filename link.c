@@ -0,0 +1,82 @@
+#include <string.h>
+#include "link.h"
+
+void ds5_link_reset(struct ds5_link *link)
+{
+	memset(link, 0, sizeof(*link));
+}
+
+/* Running averages with a 1/16 gain, as RFC 3550 does for jitter */
+static void update_timing(struct ds5_link *link, unsigned int dt)
+{
+	int dev;
+
+	if (link->interval_q4 == 0) {
+		link->interval_q4 = dt << 4;
+		return;
+	}
+
+	dev = (int)(dt << 4) - (int)link->interval_q4;
+	link->interval_q4 += dev / 16;
+
+	if (dev < 0)
+		dev = -dev;
+	link->jitter_q4 += (dev - (int)link->jitter_q4) / 16;
+
+	link->stats.interval = link->interval_q4 >> 4;
+	link->stats.jitter = link->jitter_q4 >> 4;
+}
+
+void ds5_link_update(struct ds5_link *link, unsigned int seq, unsigned int seq_mask,
+		     unsigned long long arrival)
+{
+	unsigned int modulo = seq_mask + 1;
+	unsigned int interval = link->interval_q4 >> 4;
+	unsigned int d, dt;
+
+	/* First report, or the controller switched to another report type */
+	if (!link->primed || seq_mask != link->seq_mask) {
+		link->primed = 1;
+		link->seq_mask = seq_mask;
+		link->last_seq = seq;
+		link->last_arrival = arrival;
+		link->stats.received++;
+		return;
+	}
+
+	dt = arrival - link->last_arrival > 0x0FFFFFFF ?
+		0x0FFFFFFF : arrival - link->last_arrival;
+	d = (seq - link->last_seq) & seq_mask;
+
+	if (d == 0) {
+		link->stats.duplicates++;
+		return;
+	}
+
+	if (interval && dt > (modulo / 2) * interval) {
+		/* The counter may have wrapped during a long silence, go by time */
+		unsigned int elapsed = (dt + interval / 2) / interval;
+
+		if (elapsed > d)
+			d += ((elapsed - d + modulo / 2) / modulo) * modulo;
+	} else if (d > modulo / 2) {
+		/* Behind the newest report, it arrived late */
+		link->stats.out_of_order++;
+		return;
+	}
+
+	link->stats.received++;
+
+	if (d > 1) {
+		link->stats.gaps++;
+		link->stats.lost += d - 1;
+	} else {
+		update_timing(link, dt);
+	}
+
+	if (dt > link->stats.interval_max)
+		link->stats.interval_max = dt;
+
+	link->last_seq = seq;
+	link->last_arrival = arrival;
+}
@@ -0,0 +1,25 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include "ds5vita.h"
+
+/*
+ * Report loss and jitter accounting for one connection, driven by the
+ * sequence counter every input report carries. Only updated from the
+ * BT thread.
+ */
+struct ds5_link {
+	struct ds5vita_link_stats stats;
+	int primed;
+	unsigned int seq_mask;
+	unsigned int last_seq;
+	unsigned long long last_arrival;
+	unsigned int interval_q4; /* in 1/16 us */
+	unsigned int jitter_q4;
+};
+
+void ds5_link_reset(struct ds5_link *link);
+void ds5_link_update(struct ds5_link *link, unsigned int seq, unsigned int seq_mask,
+		     unsigned long long arrival);
+
+#endif
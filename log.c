@@ -1,11 +1,41 @@
 #include "log.h"
+#include <stdarg.h>
+#include <psp2kern/kernel/threadmgr.h>
 #include <psp2kern/io/fcntl.h>
 
 extern int ksceIoMkdir(const char *, int);
 
 #ifndef RELEASE
-static unsigned int log_buf_ptr = 0;
-static char log_buf[16 * 1024];
+/* dmb on ARMv7 SMP, keeps the payload copies inside the seq updates */
+#define barrier() __sync_synchronize()
+
+#define LOG_ENTRY_TEXT   0
+#define LOG_ENTRY_RECORD 1
+#define LOG_ENTRY_HEX    2
+
+/*
+ * seq is 2 * index + 1 while the entry for index is being written and
+ * 2 * index + 2 once it is complete, so the flusher can tell a pending
+ * entry from one that was lapped by the writers.
+ */
+struct log_entry {
+	volatile unsigned int seq;
+	unsigned short type;
+	unsigned short length;
+	char data[LOG_ENTRY_SIZE - 8];
+};
+
+#define LOG_EVF_FLUSH 1
+#define LOG_EVF_STOP  2
+
+static struct log_entry log_ring[LOG_ENTRIES];
+static volatile unsigned int log_head = 0;
+static unsigned int log_tail = 0;
+static unsigned int log_dropped = 0;
+
+static SceUID log_evf_uid = -1;
+static SceUID log_thread_uid = -1;
+static volatile int log_thread_run = 1;
 #endif
 
 void log_reset()
@@ -18,33 +48,318 @@ void log_reset()
 
 	ksceIoClose(fd);
 
-	memset(log_buf, 0, sizeof(log_buf));
+	memset(log_ring, 0, sizeof(log_ring));
+	log_head = 0;
+	log_tail = 0;
+	log_dropped = 0;
 #endif
 }
 
+#ifndef RELEASE
+static struct log_entry *log_begin(unsigned int *index)
+{
+	struct log_entry *entry;
+
+	*index = __sync_fetch_and_add(&log_head, 1);
+	entry = &log_ring[*index & (LOG_ENTRIES - 1)];
+
+	entry->seq = 2 * *index + 1;
+	barrier();
+
+	return entry;
+}
+
+static void log_commit(struct log_entry *entry, unsigned int index)
+{
+	barrier();
+	entry->seq = 2 * index + 2;
+
+	/* Only the writer crossing the mark wakes the flusher up */
+	if (index - log_tail == LOG_HIGH_WATER && log_evf_uid >= 0)
+		ksceKernelSetEventFlag(log_evf_uid, LOG_EVF_FLUSH);
+}
+
+static unsigned int log_format_hex(char *buffer, unsigned int size, const char *prefix,
+				   const unsigned char *bytes, unsigned int length)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	unsigned int i, n;
+
+	n = snprintf(buffer, size, "%s", prefix);
+	for (i = 0; i < length && n + 4 < size; i++) {
+		buffer[n++] = ' ';
+		buffer[n++] = hex[bytes[i] >> 4];
+		buffer[n++] = hex[bytes[i] & 0x0F];
+	}
+	buffer[n++] = '\n';
+
+	return n;
+}
+#endif
+
 void log_write(const char *buffer, size_t length)
 {
 #ifndef RELEASE
-	if ((log_buf_ptr + length) >= sizeof(log_buf))
-		return;
+	unsigned int index;
+	struct log_entry *entry = log_begin(&index);
+
+	entry->type = LOG_ENTRY_TEXT;
 
-	memcpy(log_buf + log_buf_ptr, buffer, length);
+	/* Cut lines still end the line, or they run into the next entry */
+	if (length > sizeof(entry->data)) {
+		length = sizeof(entry->data);
+		memcpy(entry->data, buffer, length - 1);
+		entry->data[length - 1] = '\n';
+	} else {
+		memcpy(entry->data, buffer, length);
+	}
+	entry->length = length;
 
-	log_buf_ptr = log_buf_ptr + length;
+	log_commit(entry, index);
 #endif
 }
 
-void log_flush()
+void log_write_record(const char *fmt, unsigned int nargs, ...)
 {
+#if !defined(RELEASE) && defined(LOG_BINARY)
+	unsigned int args[LOG_MAX_ARGS];
+	unsigned int i, index;
+	struct log_entry *entry;
+	va_list ap;
+
+	va_start(ap, nargs);
+	for (i = 0; i < nargs; i++)
+		args[i] = va_arg(ap, unsigned int);
+	va_end(ap);
+
+	entry = log_begin(&index);
+
+	entry->type = LOG_ENTRY_RECORD;
+	entry->length = sizeof(fmt) + nargs * sizeof(args[0]);
+	memcpy(entry->data, &fmt, sizeof(fmt));
+	memcpy(entry->data + sizeof(fmt), args, nargs * sizeof(args[0]));
+
+	log_commit(entry, index);
+#endif
+}
+
+void log_write_hex(const char *prefix, const void *data, unsigned int length)
+{
+#ifndef RELEASE
+	unsigned int index;
+	struct log_entry *entry = log_begin(&index);
+
+#ifdef LOG_BINARY
+	if (length > sizeof(entry->data) - sizeof(prefix))
+		length = sizeof(entry->data) - sizeof(prefix);
+
+	entry->type = LOG_ENTRY_HEX;
+	entry->length = sizeof(prefix) + length;
+	memcpy(entry->data, &prefix, sizeof(prefix));
+	memcpy(entry->data + sizeof(prefix), data, length);
+#else
+	entry->type = LOG_ENTRY_TEXT;
+	entry->length = log_format_hex(entry->data, sizeof(entry->data),
+		prefix, data, length);
+#endif
+
+	log_commit(entry, index);
+#endif
+}
+
 #ifndef RELEASE
+/* Formats one entry into buffer, returns the text length */
+static unsigned int log_format_entry(const struct log_entry *entry,
+				     char *buffer, unsigned int size)
+{
+	const char *fmt;
+	unsigned int a[LOG_MAX_ARGS];
+	int n;
+
+	switch (entry->type) {
+	case LOG_ENTRY_RECORD:
+		memset(a, 0, sizeof(a));
+		memcpy(&fmt, entry->data, sizeof(fmt));
+		memcpy(a, entry->data + sizeof(fmt), entry->length - sizeof(fmt));
+
+		n = snprintf(buffer, size, fmt,
+			a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+		if (n < 0)
+			return 0;
+
+		if ((unsigned int)n >= size) {
+			n = size - 1;
+			buffer[n - 1] = '\n';
+		}
+		return n;
+
+	case LOG_ENTRY_HEX:
+		memcpy(&fmt, entry->data, sizeof(fmt));
+
+		return log_format_hex(buffer, size, fmt,
+			(const unsigned char *)entry->data + sizeof(fmt),
+			entry->length - sizeof(fmt));
+
+	default:
+		memcpy(buffer, entry->data, entry->length);
+		return entry->length;
+	}
+}
+
+static SceUID log_open(SceUID fd)
+{
+	if (fd >= 0)
+		return fd;
+
 	ksceIoMkdir(LOG_PATH, 6);
 
-	SceUID fd = ksceIoOpen(LOG_FILE,
-		SCE_O_WRONLY | SCE_O_CREAT | SCE_O_APPEND, 6);
-	if (fd < 0)
-		return;
+	return ksceIoOpen(LOG_FILE, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_APPEND, 6);
+}
+#endif
 
-	ksceIoWrite(fd, log_buf, strlen(log_buf));
-	ksceIoClose(fd);
+/*
+ * Writes out every completed entry since the last flush. There must be a
+ * single flusher: the log thread while it runs, whoever stops it after.
+ */
+void log_flush()
+{
+#ifndef RELEASE
+	static char out[1024];
+	unsigned int out_len = 0;
+	unsigned int dropped = 0;
+	SceUID fd = -1;
+
+	while (log_tail != log_head) {
+		const struct log_entry *entry = &log_ring[log_tail & (LOG_ENTRIES - 1)];
+		struct log_entry copy;
+		unsigned int seq = 2 * log_tail + 2;
+		int lag = entry->seq - seq;
+
+		if (log_head - log_tail > LOG_ENTRIES) {
+			dropped += log_head - LOG_ENTRIES - log_tail;
+			log_tail = log_head - LOG_ENTRIES;
+			continue;
+		}
+
+		/* Still being written, pick it up on the next flush */
+		if (lag < 0)
+			break;
+
+		if (lag == 0) {
+			memcpy(&copy, (const void *)entry, sizeof(copy));
+			barrier();
+			if (entry->seq != seq)
+				lag = 1;
+		}
+
+		log_tail++;
+
+		if (lag > 0) {
+			dropped++;
+			continue;
+		}
+
+		if (dropped) {
+			out_len += snprintf(out + out_len, sizeof(out) - out_len,
+				"*** %u log entries dropped ***\n", dropped);
+			log_dropped += dropped;
+			dropped = 0;
+		}
+
+		out_len += log_format_entry(&copy, out + out_len, sizeof(out) - out_len);
+
+		if (sizeof(out) - out_len < 256) {
+			fd = log_open(fd);
+			if (fd >= 0)
+				ksceIoWrite(fd, out, out_len);
+			out_len = 0;
+		}
+	}
+
+	if (dropped) {
+		out_len += snprintf(out + out_len, sizeof(out) - out_len,
+			"*** %u log entries dropped ***\n", dropped);
+		log_dropped += dropped;
+	}
+
+	if (out_len) {
+		fd = log_open(fd);
+		if (fd >= 0)
+			ksceIoWrite(fd, out, out_len);
+	}
+
+	if (fd >= 0)
+		ksceIoClose(fd);
+#endif
+}
+
+#ifndef RELEASE
+static int log_thread(SceSize args, void *argp)
+{
+	unsigned int bits;
+	SceUInt timeout;
+
+	while (log_thread_run) {
+		timeout = LOG_FLUSH_INTERVAL;
+		ksceKernelWaitEventFlag(log_evf_uid, LOG_EVF_FLUSH | LOG_EVF_STOP,
+			SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT, &bits, &timeout);
+
+		log_flush();
+	}
+
+	return 0;
+}
+#endif
+
+/* Starts the low priority thread that drains the ring in the background */
+int log_start()
+{
+#ifndef RELEASE
+	log_evf_uid = ksceKernelCreateEventFlag("ds5vita_log_evf", 0, 0, NULL);
+	if (log_evf_uid < 0)
+		return log_evf_uid;
+
+	log_thread_run = 1;
+	log_thread_uid = ksceKernelCreateThread("ds5vita_log_thread", log_thread,
+		0xA0, 0x1000, 0, 0x10000, 0);
+	if (log_thread_uid < 0) {
+		ksceKernelDeleteEventFlag(log_evf_uid);
+		log_evf_uid = -1;
+		return log_thread_uid;
+	}
+
+	ksceKernelStartThread(log_thread_uid, 0, NULL);
+#endif
+	return 0;
+}
+
+/*
+ * Returns < 0 if the thread did not exit in time. It is then left running,
+ * with its event flag, and the module must not be unloaded.
+ */
+int log_stop()
+{
+#ifndef RELEASE
+	SceUInt timeout = LOG_FLUSH_INTERVAL;
+
+	if (log_thread_uid >= 0) {
+		log_thread_run = 0;
+		ksceKernelSetEventFlag(log_evf_uid, LOG_EVF_STOP);
+		if (ksceKernelWaitThreadEnd(log_thread_uid, NULL, &timeout) < 0)
+			return -1;
+		ksceKernelDeleteThread(log_thread_uid);
+		log_thread_uid = -1;
+	}
+
+	if (log_dropped)
+		LOG("%u log entries dropped in total\n", log_dropped);
+
+	log_flush();
+
+	if (log_evf_uid >= 0) {
+		ksceKernelDeleteEventFlag(log_evf_uid);
+		log_evf_uid = -1;
+	}
 #endif
+	return 0;
 }
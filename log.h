@@ -7,19 +7,47 @@
 #define LOG_PATH "ux0:dump/"
 #define LOG_FILE LOG_PATH "ds4vita_log.txt"
 
+#define LOG_MAX_ARGS 8
+
+/* Ring of fixed size entries, the oldest ones get overwritten when full */
+#define LOG_ENTRY_SIZE 128
+#define LOG_ENTRIES    128
+
+/* The flush thread wakes up every LOG_FLUSH_INTERVAL us or at the high-water mark */
+#define LOG_FLUSH_INTERVAL (1000 * 1000)
+#define LOG_HIGH_WATER     (LOG_ENTRIES / 2)
+
 void log_reset();
+int log_start();
+int log_stop();
 void log_write(const char *buffer, size_t length);
+void log_write_record(const char *fmt, unsigned int nargs, ...);
+void log_write_hex(const char *prefix, const void *data, unsigned int length);
 void log_flush();
 
-#ifndef RELEASE
+/* Number of variadic arguments, 0 to LOG_MAX_ARGS */
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+
+#if defined(RELEASE)
+#  define LOG(...) (void)0
+#  define LOG_HEX(prefix, data, length) (void)0
+#elif defined(LOG_BINARY)
+/*
+ * Binary mode: only the format pointer and the raw 32-bit arguments are
+ * stored, formatting happens in log_flush(). Arguments must be int sized.
+ */
+#  define LOG(fmt, ...) \
+	log_write_record(fmt, LOG_NARGS(__VA_ARGS__), ##__VA_ARGS__)
+#  define LOG_HEX(prefix, data, length) log_write_hex(prefix, data, length)
+#else
 #  define LOG(...) \
 	do { \
 		char buffer[256]; \
 		snprintf(buffer, sizeof(buffer), ##__VA_ARGS__); \
 		log_write(buffer, strlen(buffer)); \
 	} while (0)
-#else
-#  define LOG(...) (void)0
+#  define LOG_HEX(prefix, data, length) log_write_hex(prefix, data, length)
 #endif
 
 #define TEST_CALL(f, ...) ({ \
@@ -2,155 +2,175 @@
 #include <psp2kern/kernel/threadmgr.h>
 #include <psp2kern/kernel/sysmem.h>
 #include <psp2kern/kernel/suspend.h>
+#include <psp2kern/kernel/cpu.h>
 #include <psp2kern/bt.h>
 #include <psp2kern/ctrl.h>
 #include <psp2/touch.h>
 #include <psp2/motion.h>
 #include <taihen.h>
 #include "log.h"
+#include "report.h"
+#include "state.h"
+#include "reqpool.h"
+#include "output.h"
+#include "crc32.h"
+#include "stats.h"
+#include "link.h"
+#include "capture.h"
+#include "device.h"
+#include "touch.h"
+#include "config.h"
+#include "predict.h"
 
 #define DS5_VID   0x054C
 #define DS5_PID   0x05C4
 #define DS5_2_PID 0x09CC
+#define DS5_DUALSENSE_PID      0x0CE6
+#define DS5_DUALSENSE_EDGE_PID 0x0DF2
+
+/* Entries moved per user/kernel copy, bounded by the hook's kernel stack */
+#define PATCH_CTRL_BATCH  16
+#define PATCH_TOUCH_BATCH 4
+
+/* Keeping the Vita awake only needs an occasional tick while the controller is in use */
+#define DS5_POWER_TICK_INTERVAL (500 * 1000)
+
+/*
+ * The emulated input lasts uiMake SceCtrl samples, at most 5 ms each with
+ * the shortest sampling cycle. Held input is sent again within half that.
+ */
+#define DS5_CTRL_SAMPLE_US      5000
+#define DS5_BUTTON_EMULATION_UI 32
+#define DS5_ANALOG_EMULATION_UI 1
+#define DS5_BUTTON_REFRESH (DS5_BUTTON_EMULATION_UI * DS5_CTRL_SAMPLE_US / 2)
+#define DS5_ANALOG_REFRESH (DS5_ANALOG_EMULATION_UI * DS5_CTRL_SAMPLE_US / 2)
 
-#define DS5_TOUCHPAD_W 1920
-#define DS5_TOUCHPAD_H 940
-#define DS5_ANALOG_THRESHOLD 3
+static SceUID bt_mempool_uid = -1;
+static struct ds5_req_pool req_pool;
+static SceUID bt_thread_uid = -1;
+static SceUID bt_cb_uid = -1;
+static SceUID bt_evf_uid = -1;
+static unsigned int bt_wakeups = 0;
 
-#define VITA_FRONT_TOUCHSCREEN_W 1920
-#define VITA_FRONT_TOUCHSCREEN_H 1080
+/* BT thread event flag bits */
+#define BT_EVF_OUTPUT  1 /* output changes may be due */
+#define BT_EVF_STOP    2
+#define BT_EVF_SUSPEND 4
+#define BT_EVF_RESUME  8
 
-#define abs(x) (((x) < 0) ? -(x) : (x))
+/* Sysevent phases, the handler is called for others too */
+#define DS5_SYSEVENT_SUSPEND 0x4
+#define DS5_SYSEVENT_RESUME  0x100000
 
-struct ds5_input_report {
-	unsigned char report_id;
-	unsigned char left_x;
-	unsigned char left_y;
-	unsigned char right_x;
-	unsigned char right_y;
+static SceUID sysevent_uid = -1;
 
-	unsigned char dpad     : 4;
-	unsigned char square   : 1;
-	unsigned char cross    : 1;
-	unsigned char circle   : 1;
-	unsigned char triangle : 1;
+/* Controllers to connect to again after a resume, or on load */
+static unsigned int reconnect_macs[DS5_MAX_DEVICES][2];
+static unsigned int reconnect_count = 0;
 
-	unsigned char l1      : 1;
-	unsigned char r1      : 1;
-	unsigned char l2      : 1;
-	unsigned char r2      : 1;
-	unsigned char share   : 1;
-	unsigned char options : 1;
-	unsigned char l3      : 1;
-	unsigned char r3      : 1;
+/* Pages that went out, until their controller connects or they expire */
+#define DS5_RECONNECT_TIMEOUT (10 * 1000 * 1000)
 
-	unsigned char ps   : 1;
-	unsigned char tpad : 1;
-	unsigned char cnt1 : 6;
+struct reconnect_page {
+	unsigned int mac0;
+	unsigned int mac1;
+	unsigned long long start;
+};
 
-	unsigned char l_trigger;
-	unsigned char r_trigger;
+static struct reconnect_page reconnect_paged[DS5_MAX_DEVICES];
+static unsigned int reconnect_paged_count = 0;
 
-	unsigned char cnt2;
-	unsigned char cnt3;
+/* When the page that brought this controller went out, 0 if none did */
+static unsigned long long take_reconnect_page(unsigned int mac0, unsigned int mac1)
+{
+	unsigned long long now = ksceKernelGetSystemTimeWide();
+	unsigned long long start;
+	unsigned int i;
 
-	unsigned char battery;
+	for (i = 0; i < reconnect_paged_count; i++) {
+		if (reconnect_paged[i].mac0 != mac0 || reconnect_paged[i].mac1 != mac1)
+			continue;
 
-	signed short accel_x;
-	signed short accel_y;
-	signed short accel_z;
+		start = reconnect_paged[i].start;
+		reconnect_paged[i] = reconnect_paged[--reconnect_paged_count];
 
-	union {
-		signed short roll;
-		signed short gyro_z;
-	};
-	union {
-		signed short yaw;
-		signed short gyro_y;
-	};
-	union {
-		signed short pitch;
-		signed short gyro_x;
-	};
-
-	unsigned char unk1[5];
+		return now - start < DS5_RECONNECT_TIMEOUT ? start : 0;
+	}
 
-	unsigned char battery_level : 4;
-	unsigned char usb_plugged   : 1;
-	unsigned char headphones    : 1;
-	unsigned char microphone    : 1;
-	unsigned char padding       : 1;
+	return 0;
+}
 
-	unsigned char unk2[2];
-	unsigned char trackpadpackets;
-	unsigned char packetcnt;
+/* What DS5_PAIRING_FILE holds, so it is only rewritten on a change */
+static unsigned int pairing_mac0 = 0;
+static unsigned int pairing_mac1 = 0;
 
-	unsigned int finger1_id        : 7;
-	unsigned int finger1_activelow : 1;
-	unsigned int finger1_x         : 12;
-	unsigned int finger1_y         : 12;
+/* module_stop gives the BT thread this long to disconnect and exit */
+#define DS5_BT_STOP_TIMEOUT (1000 * 1000)
 
-	unsigned int finger2_id        : 7;
-	unsigned int finger2_activelow : 1;
-	unsigned int finger2_x         : 12;
-	unsigned int finger2_y         : 12;
+/* Controller found by an inquiry, connected to once it stops */
+static unsigned int inquiry_mac0 = 0;
+static unsigned int inquiry_mac1 = 0;
 
-} __attribute__((packed, aligned(32)));
+/* Touchpad zones, compiled once at load */
+static struct ds5_touch_map touch_map;
 
-static SceUID bt_mempool_uid = -1;
-static SceUID bt_thread_uid = -1;
-static SceUID bt_cb_uid = -1;
-static int bt_thread_run = 1;
-
-static int ds5_connected = 0;
-static unsigned int ds5_mac0 = 0;
-static unsigned int ds5_mac1 = 0;
-
-static struct ds5_input_report ds5_input;
+/* How far ahead patch_analogdata may extrapolate, us, 0 is off */
+static unsigned int predict_ahead = 0;
+static unsigned int output_rate = DS5_OUTPUT_MAX_RATE_HZ;
 
 #define DECL_FUNC_HOOK(name, ...) \
 	static tai_hook_ref_t name##_ref; \
 	static SceUID name##_hook_uid = -1; \
 	static int name##_hook_func(__VA_ARGS__)
 
-static inline void ds5_input_reset(void)
-{
-	memset(&ds5_input, 0, sizeof(ds5_input));
-}
+/* Attached with the first controller, released only by module_stop */
+static int input_hooks_attached = 0;
 
-static int is_ds5(const unsigned short vid_pid[2])
+static void input_hooks_attach(void);
+
+static inline void ds5_input_reset(struct ds5_device *device)
 {
-	return (vid_pid[0] == DS5_VID) &&
-		((vid_pid[1] == DS5_PID) || (vid_pid[1] == DS5_2_PID));
+	struct ds5_state state;
+
+	memset(&state, 0, sizeof(state));
+	ds5_history_push(&device->history, ksceKernelGetSystemTimeWide(), &state);
 }
 
-static inline void *mempool_alloc(unsigned int size)
+/* Controllers that speak the native 0x31 report protocol */
+static int is_dualsense(const unsigned short vid_pid[2])
 {
-	return ksceKernelAllocHeapMemory(bt_mempool_uid, size);
+	return (vid_pid[0] == DS5_VID) &&
+		((vid_pid[1] == DS5_DUALSENSE_PID) || (vid_pid[1] == DS5_DUALSENSE_EDGE_PID));
 }
 
-static inline void mempool_free(void *ptr)
+static int is_ds5(const unsigned short vid_pid[2])
 {
-	ksceKernelFreeHeapMemory(bt_mempool_uid, ptr);
+	return ((vid_pid[0] == DS5_VID) &&
+		((vid_pid[1] == DS5_PID) || (vid_pid[1] == DS5_2_PID))) ||
+		is_dualsense(vid_pid);
 }
 
 static int ds5_send_report(unsigned int mac0, unsigned int mac1, uint8_t flags, uint8_t report,
 			    size_t len, const void *data)
 {
+	struct ds5_req_slot *slot;
 	SceBtHidRequest *req;
 	unsigned char *buf;
 
-	req = mempool_alloc(sizeof(*req));
-	if (!req) {
-		LOG("Error allocatin BT HID Request\n");
+	if (len + 1 > sizeof(slot->buf)) {
+		LOG("Report 0x%02X too long (%u)\n", report, (unsigned int)len);
 		return -1;
 	}
 
-	if ((buf = mempool_alloc((len + 1) * sizeof(*buf))) == NULL) {
-		LOG("Memory allocation error (mesg array)\n");
+	slot = ds5_req_pool_acquire(&req_pool);
+	if (!slot) {
+		LOG("BT HID Request pool exhausted\n");
 		return -1;
 	}
 
+	req = &slot->req;
+	buf = slot->buf;
+
 	buf[0] = report;
 	memcpy(buf + 1, data, len);
 
@@ -162,13 +182,13 @@ static int ds5_send_report(unsigned int mac0, unsigned int mac1, uint8_t flags,
 
 	TEST_CALL(ksceBtHidTransfer, mac0, mac1, req);
 
-	mempool_free(buf);
-	mempool_free(req);
+	ds5_req_pool_release(&req_pool, slot);
 
 	return 0;
 }
 
-static int ds5_send_0x11_report(unsigned int mac0, unsigned int mac1)
+static int ds5_send_0x11_report(struct ds5_device *device,
+				const struct ds5_output_state *state)
 {
 	unsigned char data[] = {
 		0x80,
@@ -176,16 +196,16 @@ static int ds5_send_0x11_report(unsigned int mac0, unsigned int mac1)
 		0x00,
 		0x00,
 		0x00,
-		0x00, // Motor right
-		0x00, // Motor left
-		0xFF, // R
-		0x00, // G
-		0xFF, // B
-		0xFF, // Blink on
-		0x00, // Blink off
+		state->motor_right,
+		state->motor_left,
+		state->r,
+		state->g,
+		state->b,
+		state->blink_on,
+		state->blink_off,
 	};
 
-	if (ds5_send_report(mac0, mac1, 0, 0x11, sizeof(data), data)) {
+	if (ds5_send_report(device->mac0, device->mac1, 0, 0x11, sizeof(data), data)) {
 		LOG("Status request error\n");
 		return -1;
 	}
@@ -193,6 +213,55 @@ static int ds5_send_0x11_report(unsigned int mac0, unsigned int mac1)
 	return 0;
 }
 
+static int ds5_send_0x31_report(struct ds5_device *device,
+				const struct ds5_output_state *state)
+{
+	unsigned char data[DS5_0x31_REPORT_SIZE];
+
+	memset(data, 0, sizeof(data));
+	data[0] = 0x31;
+	data[1] = (device->output_seq++ & 0x0F) << 4;
+	data[2] = 0x10; // Output tag
+	data[3] = 0x03; // Valid: compatible vibration, haptics select
+	data[4] = 0x14; // Valid: lightbar, player indicator
+	data[5] = state->motor_right;
+	data[6] = state->motor_left;
+	data[46] = state->player_leds;
+	data[47] = state->r;
+	data[48] = state->g;
+	data[49] = state->b;
+
+	ds5_report_fill_crc(data, sizeof(data));
+
+	if (ds5_send_report(device->mac0, device->mac1, 0, data[0],
+			    sizeof(data) - 1, data + 1)) {
+		LOG("Status request error\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sends the pending rumble/lightbar changes as one report, if any and
+ * if the rate limit allows it. Only ever called from the BT thread.
+ */
+static void ds5_output_pump(struct ds5_device *device)
+{
+	struct ds5_output_state state;
+
+	if (!device->connected)
+		return;
+
+	if (!ds5_output_take(&device->output, ksceKernelGetSystemTimeWide(), &state))
+		return;
+
+	if (device->native)
+		ds5_send_0x31_report(device, &state);
+	else
+		ds5_send_0x11_report(device, &state);
+}
+
 static void reset_input_emulation()
 {
 	ksceCtrlSetButtonEmulation(0, 0, 0, 0, 32);
@@ -200,104 +269,235 @@ static void reset_input_emulation()
 		0x80, 0x80, 0x80, 0x80, 0);
 }
 
-static void set_input_emulation(struct ds5_input_report *ds5)
+/*
+ * The emulated state expires after uiMake samples. It is sent when it
+ * changed, and again before it expires while anything is held or
+ * deflected. Only rest, which expiring leaves the same, is never repeated.
+ */
+static void set_input_emulation(struct ds5_device *device, const struct ds5_state *state,
+				unsigned int dirty, unsigned long long now)
+{
+	struct ds5vita_emulation_stats *stats = &device->emulation;
+
+	if ((dirty & DS5_DIRTY_BUTTONS) ||
+	    (state->buttons && now - device->buttons_sent >= DS5_BUTTON_REFRESH)) {
+		ksceCtrlSetButtonEmulation(0, 0, state->buttons, state->buttons,
+			DS5_BUTTON_EMULATION_UI);
+		device->buttons_sent = now;
+		stats->calls++;
+	} else {
+		stats->skipped++;
+	}
+
+	if ((dirty & DS5_DIRTY_ANALOG) ||
+	    ((state->moved & 0x0F) && now - device->analog_sent >= DS5_ANALOG_REFRESH)) {
+		ksceCtrlSetAnalogEmulation(0, 0, state->lx, state->ly,
+			state->rx, state->ry, state->lx, state->ly,
+			state->rx, state->ry, DS5_ANALOG_EMULATION_UI);
+		device->analog_sent = now;
+		stats->calls++;
+	} else {
+		stats->skipped++;
+	}
+}
+
+/* Ticks at most every DS5_POWER_TICK_INTERVAL while anything is held or touched */
+static void power_tick(struct ds5_device *device, const struct ds5_state *state,
+		       unsigned long long now)
 {
-	unsigned int buttons = 0;
-	int js_moved = 0;
+	if (state->buttons == 0 && !state->moved &&
+	    !state->finger[0].active && !state->finger[1].active)
+		return;
 
-	if (ds5->cross)
-		buttons |= SCE_CTRL_CROSS;
-	if (ds5->circle)
-		buttons |= SCE_CTRL_CIRCLE;
-	if (ds5->triangle)
-		buttons |= SCE_CTRL_TRIANGLE;
-	if (ds5->square)
-		buttons |= SCE_CTRL_SQUARE;
+	if (now - device->last_tick < DS5_POWER_TICK_INTERVAL) {
+		device->emulation.skipped++;
+		return;
+	}
 
-	if (ds5->dpad == 0 || ds5->dpad == 1 || ds5->dpad == 7)
-		buttons |= SCE_CTRL_UP;
-	if (ds5->dpad == 1 || ds5->dpad == 2 || ds5->dpad == 3)
-		buttons |= SCE_CTRL_RIGHT;
-	if (ds5->dpad == 3 || ds5->dpad == 4 || ds5->dpad == 5)
-		buttons |= SCE_CTRL_DOWN;
-	if (ds5->dpad == 5 || ds5->dpad == 6 || ds5->dpad == 7)
-		buttons |= SCE_CTRL_LEFT;
+	ksceKernelPowerTick(0);
+	device->last_tick = now;
+	device->emulation.calls++;
+}
 
-	if (ds5->l1)
-		buttons |= SCE_CTRL_L1;
-	if (ds5->r1)
-		buttons |= SCE_CTRL_R1;
+/*
+ * Returns the index of the newest sample that arrived at or before
+ * timestamp, or of the oldest one still in the history if none did.
+ * Arrival times are monotonic, so this is a binary search. Returns -1 if
+ * the history was cleared meanwhile, by a new controller on the port.
+ */
+static int find_sample(const struct ds5_history *history, unsigned int head,
+		       unsigned long long timestamp, struct ds5_sample *sample)
+{
+	struct ds5_sample probe;
+	unsigned int lo, hi, mid;
+
+	hi = head - 1;
+	while (ds5_history_get(history, hi, sample) < 0) {
+		/* Lapped by the writer, the newest sample is always there */
+		head = ds5_history_head(history);
+		if (head == 0)
+			return -1;
+		hi = head - 1;
+	}
 
-	if (ds5->l2)
-		buttons |= SCE_CTRL_LTRIGGER;
-	if (ds5->r2)
-		buttons |= SCE_CTRL_RTRIGGER;
+	if (sample->timestamp <= timestamp)
+		return hi;
 
-	if (ds5->l3)
-		buttons |= SCE_CTRL_L3;
-	if (ds5->r3)
-		buttons |= SCE_CTRL_R3;
+	/* Find the oldest sample newer than timestamp, it is kept in *sample */
+	lo = head > DS5_HISTORY_SIZE ? head - DS5_HISTORY_SIZE : 0;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
 
-	if (ds5->share)
-		buttons |= SCE_CTRL_SELECT;
-	if (ds5->options)
-		buttons |= SCE_CTRL_START;
-	if (ds5->ps)
-		buttons |= SCE_CTRL_INTERCEPTED;
+		if (ds5_history_get(history, mid, &probe) < 0) {
+			/* Overwritten meanwhile, so it was too old anyway */
+			lo = mid + 1;
+		} else if (probe.timestamp > timestamp) {
+			memcpy(sample, &probe, sizeof(probe));
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
 
-	if ((abs(ds5->left_x - 128) > DS5_ANALOG_THRESHOLD) ||
-	    (abs(ds5->left_y - 128) > DS5_ANALOG_THRESHOLD) ||
-	    (abs(ds5->right_x - 128) > DS5_ANALOG_THRESHOLD) ||
-	    (abs(ds5->right_y - 128) > DS5_ANALOG_THRESHOLD) ||
-	    ds5->l_trigger > DS5_ANALOG_THRESHOLD ||
-	    ds5->r_trigger > DS5_ANALOG_THRESHOLD) {
-		js_moved = 1;
+	if (hi > 0 && ds5_history_get(history, hi - 1, &probe) == 0 &&
+	    probe.timestamp <= timestamp) {
+		memcpy(sample, &probe, sizeof(probe));
+		return hi - 1;
 	}
 
-	ksceCtrlSetButtonEmulation(0, 0, buttons, buttons, 32);
+	return hi;
+}
+
+/* Bitwise select of the moved axes, no per-axis branches */
+static inline void merge_analog(SceCtrlData *data, const struct ds5_state *state)
+{
+	unsigned int sticks;
+	unsigned short triggers;
 
-	ksceCtrlSetAnalogEmulation(0, 0, ds5->left_x, ds5->left_y,
-		ds5->right_x, ds5->right_y, ds5->left_x, ds5->left_y,
-		ds5->right_x, ds5->right_y, 1);
+	memcpy(&sticks, &data->lx, sizeof(sticks));
+	sticks = (sticks & ~state->sticks_mask) | (state->sticks & state->sticks_mask);
+	memcpy(&data->lx, &sticks, sizeof(sticks));
 
-	if (buttons != 0 || js_moved)
-		ksceKernelPowerTick(0);
+	memcpy(&triggers, &data->lt, sizeof(triggers));
+	triggers = (triggers & ~state->triggers_mask) | (state->triggers & state->triggers_mask);
+	memcpy(&data->lt, &triggers, sizeof(triggers));
 }
 
+/*
+ * Moves the axes of the newest sample to where they are likely to be by
+ * now, from the two samples before it. Hides part of the Bluetooth latency
+ * when it adds up with Remote Play's.
+ */
+static void predict_analog(const struct ds5_history *history, unsigned int index,
+			   unsigned long long now, struct ds5_sample *sample)
+{
+	struct ds5_state *state = &sample->state;
+	struct ds5_sample prev, prev2;
+	unsigned int ahead;
+
+	if (index < 2 || now <= sample->timestamp ||
+	    ds5_history_get(history, index - 1, &prev) < 0 ||
+	    ds5_history_get(history, index - 2, &prev2) < 0)
+		return;
+
+	ahead = now - sample->timestamp;
+	if (ahead > predict_ahead)
+		ahead = predict_ahead;
+
+	if (ds5_predict(prev2.state.axes, prev.state.axes, state->axes,
+			sample->timestamp - prev.timestamp, ahead, state->axes))
+		ds5_state_pack_analog(state);
+}
+
+/*
+ * Fills each buffered SceCtrlData with the DS5 sample that matches its
+ * timestamp, and ORs in the buttons of every report that arrived since
+ * the previous entry so short taps between frames are not lost.
+ * The newest entry always carries the freshest report.
+ *
+ * The user buffer is moved in PATCH_CTRL_BATCH sized blocks, so a
+ * typical call costs one copy in and one copy out.
+ */
 static void patch_analogdata(int port, SceCtrlData *pad_data, int count,
-			    struct ds5_input_report *ds5)
+			    struct ds5_device *device, unsigned long long now)
 {
-	unsigned int i;
+	const struct ds5_history *history = &device->history;
+	SceCtrlData k_data[PATCH_CTRL_BATCH];
+	struct ds5_sample sample, next;
+	unsigned int head = ds5_history_head(history);
+	unsigned int index = 0;
+	unsigned int base, i, n;
+
+	if (head == 0 || count <= 0)
+		return;
 
-	for (i = 0; i < count; i++) {
-		SceCtrlData k_data;
+	for (base = 0; base < count; base += n) {
+		n = count - base;
+		if (n > PATCH_CTRL_BATCH)
+			n = PATCH_CTRL_BATCH;
+
+		ksceKernelMemcpyUserToKernel(k_data, (uintptr_t)(pad_data + base),
+			n * sizeof(*k_data));
+
+		for (i = 0; i < n; i++) {
+			unsigned long long limit;
+			unsigned int buttons;
+
+			limit = (base + i == count - 1) ? ~0ULL : k_data[i].timeStamp;
+
+			if (base + i == 0) {
+				int found = find_sample(history, head, limit, &sample);
+
+				if (found < 0)
+					return;
+				index = found;
+				buttons = sample.state.buttons;
+			} else {
+				buttons = 0;
+				while (index + 1 < head &&
+				       ds5_history_get(history, index + 1, &next) == 0 &&
+				       next.timestamp <= limit) {
+					memcpy(&sample, &next, sizeof(next));
+					buttons |= next.state.buttons;
+					index++;
+				}
+				if (!buttons)
+					buttons = sample.state.buttons;
+			}
+
+			if (predict_ahead && base + i == count - 1)
+				predict_analog(history, index, now, &sample);
 
-		ksceKernelMemcpyUserToKernel(&k_data, (uintptr_t)pad_data, sizeof(k_data));
-		if (abs(ds5->left_x - 128) > DS5_ANALOG_THRESHOLD)
-			k_data.lx = ds5->left_x;
-		if (abs(ds5->left_y - 128) > DS5_ANALOG_THRESHOLD)
-			k_data.ly = ds5->left_y;
-		if (abs(ds5->right_x - 128) > DS5_ANALOG_THRESHOLD)
-			k_data.rx = ds5->right_x;
-		if (abs(ds5->right_y - 128) > DS5_ANALOG_THRESHOLD)
-			k_data.ry = ds5->right_y;
-		if (ds5->l_trigger > DS5_ANALOG_THRESHOLD)
-			k_data.lt = ds5->l_trigger;
-		if (ds5->r_trigger > DS5_ANALOG_THRESHOLD)
-			k_data.rt = ds5->r_trigger;
-		ksceKernelMemcpyKernelToUser((uintptr_t)pad_data, &k_data, sizeof(k_data));
+			merge_analog(&k_data[i], &sample.state);
+			k_data[i].buttons |= buttons;
+		}
 
-		pad_data++;
+		ksceKernelMemcpyKernelToUser((uintptr_t)(pad_data + base), k_data,
+			n * sizeof(*k_data));
 	}
+
+	/* The last entry got the newest sample, the first call to see it delivers it */
+	ds5_stats_deliver(&device->delivered, index, now - sample.timestamp);
 }
 
 DECL_FUNC_HOOK(SceCtrl_ksceCtrlGetControllerPortInfo, SceCtrlPortInfo *info)
 {
-	int ret = TAI_CONTINUE(int, SceCtrl_ksceCtrlGetControllerPortInfo_ref, info);
+	int ret;
+
+	ret = TAI_CONTINUE(int, SceCtrl_ksceCtrlGetControllerPortInfo_ref, info);
+
+	if (ret >= 0) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		unsigned int port;
+
+		for (port = 1; port <= DS5_MAX_DEVICES; port++) {
+			if (ds5_device_by_port(port)) {
+				// info->port[0] |= SCE_CTRL_TYPE_VIRT;
+				info->port[port] = SCE_CTRL_TYPE_DS4;
+			}
+		}
 
-	if (ret >= 0 && ds5_connected) {
-		// info->port[0] |= SCE_CTRL_TYPE_VIRT;
-		info->port[1] = SCE_CTRL_TYPE_DS4;
+		ds5_stats_hook(DS5VITA_HOOK_CTRL_PORT_INFO, ksceKernelGetSystemTimeWide() - start);
 	}
 
 	return ret;
@@ -305,19 +505,29 @@ DECL_FUNC_HOOK(SceCtrl_ksceCtrlGetControllerPortInfo, SceCtrlPortInfo *info)
 
 DECL_FUNC_HOOK(SceCtrl_sceCtrlGetBatteryInfo, int port, SceUInt8 *batt)
 {
-	int ret = TAI_CONTINUE(int, SceCtrl_sceCtrlGetBatteryInfo_ref, port, batt);
+	int ret;
+
+	ret = TAI_CONTINUE(int, SceCtrl_sceCtrlGetBatteryInfo_ref, port, batt);
 
-	if (ds5_connected && port == 1) {
+	struct ds5_device *device = ds5_device_by_port(port);
+
+	if (device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		struct ds5_state state;
 		SceUInt8 k_batt;
+
+		ds5_history_latest(&device->history, &state);
+
 		ksceKernelMemcpyUserToKernel(&k_batt, (uintptr_t)batt, sizeof(k_batt));
-		if (ds5_input.usb_plugged) {
-			k_batt = ds5_input.battery_level <= 10 ? 0xEE : 0xEF;
+		if (state.usb_plugged) {
+			k_batt = state.battery_level <= 10 ? 0xEE : 0xEF;
 		} else {
-			if (ds5_input.battery_level == 0) k_batt = 0;
-			else k_batt = (ds5_input.battery_level / 2) + 1;
+			if (state.battery_level == 0) k_batt = 0;
+			else k_batt = (state.battery_level / 2) + 1;
 			if (k_batt > 5) k_batt = 5;
 		}
 		ksceKernelMemcpyKernelToUser((uintptr_t)batt, &k_batt, sizeof(k_batt));
+		ds5_stats_hook(DS5VITA_HOOK_CTRL_BATTERY_INFO, ksceKernelGetSystemTimeWide() - start);
 		return 0;
 	}
 
@@ -326,153 +536,375 @@ DECL_FUNC_HOOK(SceCtrl_sceCtrlGetBatteryInfo, int port, SceUInt8 *batt)
 
 DECL_FUNC_HOOK(SceCtrl_sceCtrlPeekBufferPositive2, int port, SceCtrlData *pad_data, int count)
 {
-	int ret = TAI_CONTINUE(int, SceCtrl_sceCtrlPeekBufferPositive2_ref, port, pad_data, count);
+	int ret;
+
+	ret = TAI_CONTINUE(int, SceCtrl_sceCtrlPeekBufferPositive2_ref, port, pad_data, count);
 
-	if (ret >= 0 && ds5_connected)
-		patch_analogdata(port, pad_data, count, &ds5_input);
+	struct ds5_device *device = ds5_device_by_port(port ? port : 1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		patch_analogdata(port, pad_data, count, device, start);
+		ds5_stats_hook(DS5VITA_HOOK_CTRL_PEEK_POSITIVE2, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
 DECL_FUNC_HOOK(SceCtrl_sceCtrlReadBufferPositive2, int port, SceCtrlData *pad_data, int count)
 {
-	int ret = TAI_CONTINUE(int, SceCtrl_sceCtrlReadBufferPositive2_ref, port, pad_data, count);
+	int ret;
+
+	ret = TAI_CONTINUE(int, SceCtrl_sceCtrlReadBufferPositive2_ref, port, pad_data, count);
 
-	if (ret >= 0 && ds5_connected)
-		patch_analogdata(port, pad_data, count, &ds5_input);
+	struct ds5_device *device = ds5_device_by_port(port ? port : 1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		patch_analogdata(port, pad_data, count, device, start);
+		ds5_stats_hook(DS5VITA_HOOK_CTRL_READ_POSITIVE2, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
 DECL_FUNC_HOOK(SceCtrl_sceCtrlPeekBufferPositiveExt2, int port, SceCtrlData *pad_data, int count)
 {
-	int ret = TAI_CONTINUE(int, SceCtrl_sceCtrlPeekBufferPositiveExt2_ref, port, pad_data, count);
+	int ret;
 
-	if (ret >= 0 && ds5_connected)
-		patch_analogdata(port, pad_data, count, &ds5_input);
+	ret = TAI_CONTINUE(int, SceCtrl_sceCtrlPeekBufferPositiveExt2_ref, port, pad_data, count);
+
+	struct ds5_device *device = ds5_device_by_port(port ? port : 1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		patch_analogdata(port, pad_data, count, device, start);
+		ds5_stats_hook(DS5VITA_HOOK_CTRL_PEEK_POSITIVE_EXT2, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
 DECL_FUNC_HOOK(SceCtrl_sceCtrlReadBufferPositiveExt2, int port, SceCtrlData *pad_data, int count)
 {
-	int ret = TAI_CONTINUE(int, SceCtrl_sceCtrlReadBufferPositiveExt2_ref, port, pad_data, count);
+	int ret;
 
-	if (ret >= 0 && ds5_connected)
-		patch_analogdata(port, pad_data, count, &ds5_input);
+	ret = TAI_CONTINUE(int, SceCtrl_sceCtrlReadBufferPositiveExt2_ref, port, pad_data, count);
+
+	struct ds5_device *device = ds5_device_by_port(port ? port : 1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		patch_analogdata(port, pad_data, count, device, start);
+		ds5_stats_hook(DS5VITA_HOOK_CTRL_READ_POSITIVE_EXT2, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
+/*
+ * The frame was mapped by the BT thread, this only fans it out over the
+ * buffers. The BT thread also keeps the Vita awake while fingers are down.
+ */
 static void patch_touchdata(SceUInt32 port, SceTouchData *pData, SceUInt32 nBufs,
-			    struct ds5_input_report *ds5)
+			    const struct ds5_touch_frame *frame)
 {
-	unsigned int i;
+	SceTouchData k_data[PATCH_TOUCH_BATCH];
+	unsigned int num_reports;
+	unsigned int base, i, n;
 
-	if (port != SCE_TOUCH_PORT_FRONT)
+	if (port >= DS5_TOUCH_PORTS)
 		return;
 
-	for (i = 0; i < nBufs; i++) {
-		unsigned int num_reports = 0;
+	num_reports = frame->num[port];
+	if (num_reports == 0)
+		return;
 
-		if (!ds5->finger1_activelow) {
-			pData->report[0].id = ds5->finger1_id;
-			pData->report[0].x = (ds5->finger1_x * VITA_FRONT_TOUCHSCREEN_W) / DS5_TOUCHPAD_W;
-			pData->report[0].y = (ds5->finger1_y * VITA_FRONT_TOUCHSCREEN_H) / DS5_TOUCHPAD_H;
-			num_reports++;
-		}
+	for (base = 0; base < nBufs; base += n) {
+		n = nBufs - base;
+		if (n > PATCH_TOUCH_BATCH)
+			n = PATCH_TOUCH_BATCH;
 
-		if (!ds5->finger2_activelow) {
-			pData->report[1].id = ds5->finger2_id;
-			pData->report[1].x = (ds5->finger2_x * VITA_FRONT_TOUCHSCREEN_W) / DS5_TOUCHPAD_W;
-			pData->report[1].y = (ds5->finger2_y * VITA_FRONT_TOUCHSCREEN_H) / DS5_TOUCHPAD_H;
-			num_reports++;
-		}
+		ksceKernelMemcpyUserToKernel(k_data, (uintptr_t)(pData + base),
+			n * sizeof(*k_data));
 
-		if (num_reports > 0) {
-			ksceKernelPowerTick(0);
-			pData->reportNum = num_reports;
+		for (i = 0; i < n; i++) {
+			memcpy(k_data[i].report, frame->report[port],
+				num_reports * sizeof(*k_data[i].report));
+			k_data[i].reportNum = num_reports;
 		}
 
-		pData++;
+		ksceKernelMemcpyKernelToUser((uintptr_t)(pData + base), k_data,
+			n * sizeof(*k_data));
 	}
 }
 
 DECL_FUNC_HOOK(SceTouch_ksceTouchPeek, SceUInt32 port, SceTouchData *pData, SceUInt32 nBufs)
 {
-	int ret = TAI_CONTINUE(int, SceTouch_ksceTouchPeek_ref, port, pData, nBufs);
+	int ret;
+
+	ret = TAI_CONTINUE(int, SceTouch_ksceTouchPeek_ref, port, pData, nBufs);
+
+	struct ds5_device *device = ds5_device_by_port(1);
 
-	if (ret >= 0 && ds5_connected)
-		patch_touchdata(port, pData, nBufs, &ds5_input);
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		struct ds5_touch_frame frame;
+		ds5_touch_read(&device->touch, &frame);
+		patch_touchdata(port, pData, nBufs, &frame);
+		ds5_stats_hook(DS5VITA_HOOK_TOUCH_PEEK, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
 DECL_FUNC_HOOK(SceTouch_ksceTouchPeekRegion, SceUInt32 port, SceTouchData *pData, SceUInt32 nBufs, int region)
 {
-	int ret = TAI_CONTINUE(int, SceTouch_ksceTouchPeekRegion_ref, port, pData, nBufs, region);
+	int ret;
 
-	if (ret >= 0 && ds5_connected)
-		patch_touchdata(port, pData, nBufs, &ds5_input);
+	ret = TAI_CONTINUE(int, SceTouch_ksceTouchPeekRegion_ref, port, pData, nBufs, region);
+
+	struct ds5_device *device = ds5_device_by_port(1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		struct ds5_touch_frame frame;
+		ds5_touch_read(&device->touch, &frame);
+		patch_touchdata(port, pData, nBufs, &frame);
+		ds5_stats_hook(DS5VITA_HOOK_TOUCH_PEEK_REGION, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
 DECL_FUNC_HOOK(SceTouch_ksceTouchRead, SceUInt32 port, SceTouchData *pData, SceUInt32 nBufs)
 {
-	int ret = TAI_CONTINUE(int, SceTouch_ksceTouchRead_ref, port, pData, nBufs);
+	int ret;
+
+	ret = TAI_CONTINUE(int, SceTouch_ksceTouchRead_ref, port, pData, nBufs);
 
-	if (ret >= 0 && ds5_connected)
-		patch_touchdata(port, pData, nBufs, &ds5_input);
+	struct ds5_device *device = ds5_device_by_port(1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		struct ds5_touch_frame frame;
+		ds5_touch_read(&device->touch, &frame);
+		patch_touchdata(port, pData, nBufs, &frame);
+		ds5_stats_hook(DS5VITA_HOOK_TOUCH_READ, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
 DECL_FUNC_HOOK(SceTouch_ksceTouchReadRegion, SceUInt32 port, SceTouchData *pData, SceUInt32 nBufs, int region)
 {
-	int ret = TAI_CONTINUE(int, SceTouch_ksceTouchReadRegion_ref, port, pData, nBufs, region);
+	int ret;
+
+	ret = TAI_CONTINUE(int, SceTouch_ksceTouchReadRegion_ref, port, pData, nBufs, region);
 
-	if (ret >= 0 && ds5_connected)
-		patch_touchdata(port, pData, nBufs, &ds5_input);
+	struct ds5_device *device = ds5_device_by_port(1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		struct ds5_touch_frame frame;
+		ds5_touch_read(&device->touch, &frame);
+		patch_touchdata(port, pData, nBufs, &frame);
+		ds5_stats_hook(DS5VITA_HOOK_TOUCH_READ_REGION, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
-static void patch_motion_state(SceMotionState *motionState, struct ds5_input_report *ds5)
+static inline void set_matrix_row(SceFVector4 *row, const float m[3])
+{
+	row->x = m[0];
+	row->y = m[1];
+	row->z = m[2];
+	row->w = 0.0f;
+}
+
+/* Everything was computed by the BT thread, this only copies it */
+static void patch_motion_state(SceMotionState *motionState,
+			       const struct ds5_motion_sample *sample)
 {
 	SceMotionState k_data;
 	SceMotionState *u_data = motionState;
 
 	ksceKernelMemcpyUserToKernel(&k_data, (uintptr_t)u_data, sizeof(k_data));
-	k_data.acceleration.x = ds5->accel_x;
-	k_data.acceleration.y = ds5->accel_y;
-	k_data.acceleration.y = ds5->accel_z;
+
+	k_data.acceleration.x = sample->accel[0];
+	k_data.acceleration.y = sample->accel[1];
+	k_data.acceleration.z = sample->accel[2];
+	k_data.angularVelocity.x = sample->gyro[0];
+	k_data.angularVelocity.y = sample->gyro[1];
+	k_data.angularVelocity.z = sample->gyro[2];
+
+	k_data.deviceQuat.x = sample->quat[0];
+	k_data.deviceQuat.y = sample->quat[1];
+	k_data.deviceQuat.z = sample->quat[2];
+	k_data.deviceQuat.w = sample->quat[3];
+
+	set_matrix_row(&k_data.rotationMatrix.x, sample->matrix[0]);
+	set_matrix_row(&k_data.rotationMatrix.y, sample->matrix[1]);
+	set_matrix_row(&k_data.rotationMatrix.z, sample->matrix[2]);
+	k_data.rotationMatrix.w.x = 0.0f;
+	k_data.rotationMatrix.w.y = 0.0f;
+	k_data.rotationMatrix.w.z = 0.0f;
+	k_data.rotationMatrix.w.w = 1.0f;
+
 	ksceKernelMemcpyKernelToUser((uintptr_t)u_data, &k_data, sizeof(k_data));
 }
 
 DECL_FUNC_HOOK(SceMotion_sceMotionGetState, SceMotionState *motionState)
 {
-	int ret = TAI_CONTINUE(int, SceMotion_sceMotionGetState_ref, motionState);
+	int ret;
 
-	if (ret >= 0 && ds5_connected)
-		patch_motion_state(motionState, &ds5_input);
+	ret = TAI_CONTINUE(int, SceMotion_sceMotionGetState_ref, motionState);
+
+	struct ds5_device *device = ds5_device_by_port(1);
+
+	if (ret >= 0 && device) {
+		unsigned long long start = ksceKernelGetSystemTimeWide();
+		struct ds5_motion_sample sample;
+		ds5_motion_read(&device->motion, &sample);
+		patch_motion_state(motionState, &sample);
+		ds5_stats_hook(DS5VITA_HOOK_MOTION_GET_STATE, ksceKernelGetSystemTimeWide() - start);
+	}
 
 	return ret;
 }
 
-static void enqueue_read_request(unsigned int mac0, unsigned int mac1,
-				 SceBtHidRequest *request, unsigned char *buffer,
-				 unsigned int length)
+/*
+ * arrival is when bt_cb_func read the event, it also dates the sample.
+ * The controller on port 1 also drives the system's own port 0 through
+ * the emulation calls, the others only reach games through the hooks.
+ */
+static void ds5_process_report(struct ds5_device *device, const unsigned char *report,
+			       const struct ds5_layout *layout, unsigned long long arrival)
+{
+	struct ds5vita_emulation_stats *stats = &device->emulation;
+	struct ds5_state state;
+	unsigned long long decoded;
+	unsigned int dirty, i;
+
+	ds5_decode_report(report, layout, &state);
+	ds5_history_push(&device->history, arrival, &state);
+
+	if (device->reconnect_start) {
+		unsigned long long elapsed = arrival - device->reconnect_start;
+
+		if (elapsed < DS5_RECONNECT_TIMEOUT) {
+			ds5_stats_stage(DS5VITA_STAGE_RECONNECT, elapsed);
+			LOG("First report %u us after the reconnect started\n",
+				(unsigned int)elapsed);
+		}
+		device->reconnect_start = 0;
+	}
+	ds5_link_update(&device->link, state.seq, layout->seq_mask, arrival);
+
+	dirty = device->dirty | ds5_state_diff(&device->last, &state);
+	device->dirty = 0;
+	memcpy(&device->last, &state, sizeof(state));
+
+	stats->reports++;
+	for (i = 0; i < DS5VITA_SUBSYSTEM_MAX; i++)
+		stats->dirty[i] += (dirty >> i) & 1;
+
+	/* The filter integrates over time, it takes every sample */
+	ds5_motion_update(&device->motion, state.accel, state.gyro, arrival);
+	if (dirty & DS5_DIRTY_TOUCH)
+		ds5_touch_update(&device->touch, state.finger);
+
+	decoded = ksceKernelGetSystemTimeWide();
+	ds5_stats_stage(DS5VITA_STAGE_DECODE, decoded - arrival);
+
+	if (device->port == 1)
+		set_input_emulation(device, &state, dirty, arrival);
+	power_tick(device, &state, arrival);
+	ds5_stats_stage(DS5VITA_STAGE_EMULATE, ksceKernelGetSystemTimeWide() - decoded);
+
+	ds5_output_pump(device);
+}
+
+static void post_read(struct ds5_device *device, struct ds5_read *read)
 {
+	SceBtHidRequest *request = &read->request;
+
 	memset(request, 0, sizeof(*request));
-	memset(buffer, 0, length);
+	memset(read->buff, 0, sizeof(read->buff));
 
 	request->type = 0;
-	request->buffer = buffer;
-	request->length = length;
+	request->buffer = read->buff;
+	request->length = sizeof(read->buff);
+	request->next = request;
+
+	ksceBtHidTransfer(device->mac0, device->mac1, request);
+}
+
+/* The reply fills the buffer in place and comes back as a 0x0C event */
+static void request_calib(struct ds5_device *device)
+{
+	SceBtHidRequest *request = &device->calib.request;
+
+	memset(request, 0, sizeof(*request));
+	memset(device->calib.buff, 0, sizeof(device->calib.buff));
+	device->calib.buff[0] = DS5_CALIB_REPORT_ID;
+
+	request->type = 2; // 0x43 (GET_REPORT | FEATURE) -> type = 2
+	request->buffer = device->calib.buff;
+	request->length = DS5_CALIB_REPORT_SIZE;
 	request->next = request;
 
-	ksceBtHidTransfer(mac0, mac1, request);
+	ksceBtHidTransfer(device->mac0, device->mac1, request);
+}
+
+/* Posts the whole ring once the controller answered the first output report */
+static void post_reads(struct ds5_device *device)
+{
+	unsigned int i;
+
+	if (device->reads_posted)
+		return;
+
+	for (i = 0; i < DS5_READ_DEPTH; i++)
+		post_read(device, &device->reads[i]);
+
+	device->read_head = 0;
+	device->reads_posted = 1;
+}
+
+/*
+ * The completed read, normally the oldest one. The buffers are zeroed
+ * when posted, so a stray completion order shows up as an empty head.
+ */
+static struct ds5_read *completed_read(struct ds5_device *device)
+{
+	unsigned int i;
+
+	for (i = 0; i < DS5_READ_DEPTH; i++) {
+		unsigned int slot = (device->read_head + i) % DS5_READ_DEPTH;
+
+		if (device->reads[slot].buff[0] != 0) {
+			if (i)
+				device->read_skips++;
+			device->read_head = (slot + 1) % DS5_READ_DEPTH;
+			return &device->reads[slot];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The input hooks are deliberately not released on the last disconnect,
+ * see input_hooks_detach().
+ */
+static void ds5_disconnect(struct ds5_device *device)
+{
+	if (device->port == 1)
+		reset_input_emulation();
+
+	ds5_device_remove(device);
 }
 
 DECL_FUNC_HOOK(SceBt_sub_22999C8, void *dev_base_ptr, int r1)
@@ -497,17 +929,52 @@ DECL_FUNC_HOOK(SceBt_sub_22999C8, void *dev_base_ptr, int r1)
 	return TAI_CONTINUE(int, SceBt_sub_22999C8_ref, dev_base_ptr, r1);
 }
 
-static int bt_cb_func(int notifyId, int notifyCount, int notifyArg, void *common)
+/* DualSense player indicator patterns for ports 1-4, as the PS5 shows them */
+static const unsigned char player_leds[DS5_MAX_DEVICES] = {
+	0x04, 0x0A, 0x15, 0x1B,
+};
+
+/* Up to the last non-zero byte, the read buffer is cleared before each read */
+static unsigned int report_length(const unsigned char *report, unsigned int size)
 {
-	static SceBtHidRequest hid_request;
-	static unsigned char recv_buff[0x100];
+	while (size > 0 && report[size - 1] == 0)
+		size--;
+
+	return size;
+}
+
+/* Earliest ds5_output_due() over the connected controllers */
+static unsigned int output_due(void)
+{
+	unsigned long long now = ksceKernelGetSystemTimeWide();
+	unsigned int i, due = DS5_OUTPUT_IDLE;
+
+	for (i = 0; i < DS5_MAX_DEVICES; i++) {
+		const struct ds5_device *device = &ds5_devices[i];
+		unsigned int d;
+
+		if (!device->connected)
+			continue;
+
+		d = ds5_output_due(&device->output, now);
+		if (d < due)
+			due = d;
+	}
+
+	return due;
+}
 
+static int bt_cb_func(int notifyId, int notifyCount, int notifyArg, void *common)
+{
 	while (1) {
 		int ret;
 		SceBtEvent hid_event;
+		struct ds5_device *device;
+		unsigned long long start, arrival;
 
 		memset(&hid_event, 0, sizeof(hid_event));
 
+		start = ksceKernelGetSystemTimeWide();
 		do {
 			ret = ksceBtReadEvent(&hid_event, 1);
 		} while (ret == SCE_BT_ERROR_CB_OVERFLOW);
@@ -516,37 +983,34 @@ static int bt_cb_func(int notifyId, int notifyCount, int notifyArg, void *common
 			break;
 		}
 
-		LOG("->Event:");
-		for (int i = 0; i < 0x10; i++)
-			LOG(" %02X", hid_event.data[i]);
-		LOG("\n");
-
-		/*
-		 * If we get an event with a MAC, and the MAC is different
-		 * from the connected DS5, skip the event.
-		 */
-		if (ds5_connected) {
-			if (hid_event.mac0 != ds5_mac0 || hid_event.mac1 != ds5_mac1)
-				continue;
-		}
+		arrival = ksceKernelGetSystemTimeWide();
+		ds5_stats_stage(DS5VITA_STAGE_READ, arrival - start);
+
+		ds5_capture_event(&hid_event, arrival);
+
+		LOG_HEX("->Event:", hid_event.data, 0x10);
+
+		device = ds5_device_find(hid_event.mac0, hid_event.mac1);
 
 		switch (hid_event.id) {
 		case 0x01: { /* Inquiry result event */
 			unsigned short vid_pid[2];
 			ksceBtGetVidPid(hid_event.mac0, hid_event.mac1, vid_pid);
+			ds5_capture_vid_pid(hid_event.mac0, hid_event.mac1, vid_pid, arrival);
 
-			if (is_ds5(vid_pid)) {
+			if (!device && is_ds5(vid_pid)) {
 				ksceBtStopInquiry();
-				ds5_mac0 = hid_event.mac0;
-				ds5_mac1 = hid_event.mac1;
+				inquiry_mac0 = hid_event.mac0;
+				inquiry_mac1 = hid_event.mac1;
 			}
 			break;
 		}
 
 		case 0x02: /* Inquiry stop event */
-			if (!ds5_connected) {
-				if (ds5_mac0 || ds5_mac1)
-					ksceBtStartConnect(ds5_mac0, ds5_mac1);
+			if (inquiry_mac0 || inquiry_mac1) {
+				if (!ds5_device_find(inquiry_mac0, inquiry_mac1))
+					ksceBtStartConnect(inquiry_mac0, inquiry_mac1);
+				inquiry_mac0 = inquiry_mac1 = 0;
 			}
 			break;
 
@@ -557,21 +1021,58 @@ static int bt_cb_func(int notifyId, int notifyCount, int notifyArg, void *common
 		case 0x05: { /* Connection accepted event */
 			unsigned short vid_pid[2];
 			ksceBtGetVidPid(hid_event.mac0, hid_event.mac1, vid_pid);
+			ds5_capture_vid_pid(hid_event.mac0, hid_event.mac1, vid_pid, arrival);
+
+			if (device || !is_ds5(vid_pid))
+				break;
 
-			if (is_ds5(vid_pid)) {
-				ds5_input_reset();
-				ds5_mac0 = hid_event.mac0;
-				ds5_mac1 = hid_event.mac1;
-				ds5_connected = 1;
-				ds5_send_0x11_report(hid_event.mac0, hid_event.mac1);
+			device = ds5_device_add(hid_event.mac0, hid_event.mac1);
+			if (!device) {
+				LOG("No free port for another DS5\n");
+				break;
 			}
+
+			input_hooks_attach();
+			device->reconnect_start = take_reconnect_page(hid_event.mac0,
+				hid_event.mac1);
+
+			if (hid_event.mac0 != pairing_mac0 || hid_event.mac1 != pairing_mac1) {
+				pairing_mac0 = hid_event.mac0;
+				pairing_mac1 = hid_event.mac1;
+				if (ds5_pairing_save(pairing_mac0, pairing_mac1) < 0)
+					LOG("Error saving " DS5_PAIRING_FILE "\n");
+			}
+
+			ds5_input_reset(device);
+			ds5_motion_init(&device->motion);
+			ds5_touch_init(&device->touch, &touch_map);
+			ds5_link_reset(&device->link);
+			device->dirty = DS5_DIRTY_ALL;
+			device->native = is_dualsense(vid_pid);
+			device->connected = 1;
+			LOG("DS5 connected on port %u\n", device->port);
+
+			/*
+			 * The first output report also switches the controller to
+			 * its full input reports (0x11, or 0x31 on a DualSense).
+			 */
+			ds5_output_init(&device->output, output_rate);
+			ds5_output_set_rumble(&device->output, 0x00, 0x00);
+			ds5_output_set_lightbar(&device->output, 0xFF, 0x00, 0xFF, 0xFF, 0x00);
+			ds5_output_set_player_leds(&device->output, player_leds[device->port - 1]);
+			ds5_output_pump(device);
+
+			/* Nominal resolutions until it answers */
+			request_calib(device);
 			break;
 		}
 
 
 		case 0x06: /* Device disconnect event*/
-			ds5_connected = 0;
-			reset_input_emulation();
+			if (device) {
+				LOG("DS5 disconnected from port %u\n", device->port);
+				ds5_disconnect(device);
+			}
 			break;
 
 		case 0x08: /* Connection requested event */
@@ -587,60 +1088,445 @@ static int bt_cb_func(int notifyId, int notifyCount, int notifyArg, void *common
 			 */
 			break;
 
-		case 0x0A: /* HID reply to 0-type request */
+		case 0x0A: { /* HID reply to 0-type request */
+			struct ds5_read *read;
+			const unsigned char *report;
 
-			LOG("DS5 0x0A event: 0x%02X\n", recv_buff[0]);
+			if (!device)
+				break;
 
-			switch (recv_buff[0]) {
-			case 0x11:
-				memcpy(&ds5_input, recv_buff, sizeof(ds5_input));
+			read = completed_read(device);
+			if (!read) {
+				LOG("DS5 0x0A event without a filled read\n");
+				break;
+			}
+			report = read->buff;
 
-				set_input_emulation(&ds5_input);
+			LOG("DS5 0x0A event: 0x%02X\n", report[0]);
 
-				enqueue_read_request(hid_event.mac0, hid_event.mac1,
-					&hid_request, recv_buff, sizeof(recv_buff));
+			ds5_capture_report(report, report_length(report, sizeof(read->buff)),
+				arrival);
+
+			switch (report[0]) {
+			case 0x11:
+				ds5_process_report(device, report, &ds5_layout_0x11, arrival);
+				break;
+
+			case 0x31:
+				if (ds5_report_crc_ok(report, &ds5_layout_0x31)) {
+					ds5_process_report(device, report, &ds5_layout_0x31, arrival);
+				} else {
+					device->crc_errors++;
+					LOG("DS5 0x31 report CRC mismatch, dropped\n");
+				}
 				break;
 
 			default:
-				LOG("Unknown DS5 event: 0x%02X\n", recv_buff[0]);
+				LOG("Unknown DS5 event: 0x%02X\n", report[0]);
 				break;
 			}
 
+			/* The rest of the ring stayed posted meanwhile */
+			post_read(device, read);
+
 			break;
+		}
 
 		case 0x0B: /* HID reply to 1-type request */
 
-			//LOG("DS5 0x0B event: 0x%02X\n", recv_buff[0]);
+			if (device)
+				post_reads(device);
+
+			break;
+
+		case 0x0C: { /* HID reply to 2-type request */
+			struct ds5_motion_calib calib;
 
-			enqueue_read_request(hid_event.mac0, hid_event.mac1,
-				&hid_request, recv_buff, sizeof(recv_buff));
+			if (!device)
+				break;
 
+			if (ds5_report_parse_calib(device->calib.buff, sizeof(device->calib.buff),
+						   device->native, &calib) < 0) {
+				LOG("DS5 on port %u: bad calibration report\n", device->port);
+				break;
+			}
+
+			ds5_motion_set_calib(&device->motion, &calib);
+			LOG("DS5 on port %u: motion calibration read\n", device->port);
 			break;
 		}
+		}
+	}
+
+	/* Let the thread re-arm its timeout if an output report was deferred */
+	if (output_due() != DS5_OUTPUT_IDLE)
+		ksceKernelSetEventFlag(bt_evf_uid, BT_EVF_OUTPUT);
+
+	return 0;
+}
+
+/* Names go into the format itself, binary log records only carry ints */
+#define LOG_HISTOGRAM(name, h) \
+	LOG("Latency " name ": %u samples, p50 <= %u us, p99 <= %u us, max %u us\n", \
+		(h)->count, ds5vita_histogram_percentile(h, 500), \
+		ds5vita_histogram_percentile(h, 990), (h)->max)
+
+static void log_latency_stats(void)
+{
+#ifndef RELEASE
+	struct ds5vita_latency_stats stats;
+	unsigned int i;
+
+	ds5_stats_get(&stats);
+
+	LOG_HISTOGRAM("read", &stats.stage[DS5VITA_STAGE_READ]);
+	LOG_HISTOGRAM("decode", &stats.stage[DS5VITA_STAGE_DECODE]);
+	LOG_HISTOGRAM("emulate", &stats.stage[DS5VITA_STAGE_EMULATE]);
+	LOG_HISTOGRAM("deliver", &stats.stage[DS5VITA_STAGE_DELIVER]);
+	LOG_HISTOGRAM("reconnect", &stats.stage[DS5VITA_STAGE_RECONNECT]);
+
+	for (i = 0; i < DS5VITA_HOOK_MAX; i++) {
+		const struct ds5vita_hook_stats *h = &stats.hook[i];
+
+		if (h->calls)
+			LOG("Hook %u: %u calls, %u us total, max %u us\n",
+				i, h->calls, (unsigned int)h->time, h->max);
+	}
+#endif
+}
+
+int ds5vitaGetLatencyStats(struct ds5vita_latency_stats *stats, unsigned int size)
+{
+	if (!stats || size != sizeof(*stats))
+		return -1;
+
+	ds5_stats_get(stats);
+	return 0;
+}
+
+int ds5vitaGetLinkStats(unsigned int port, struct ds5vita_link_stats *stats, unsigned int size)
+{
+	struct ds5_device *device = ds5_device_by_port(port);
+
+	if (!device || !stats || size != sizeof(*stats))
+		return -1;
+
+	memcpy(stats, &device->link.stats, sizeof(*stats));
+	return 0;
+}
+
+int ds5vitaGetEmulationStats(unsigned int port, struct ds5vita_emulation_stats *stats,
+			     unsigned int size)
+{
+	struct ds5_device *device = ds5_device_by_port(port);
+
+	if (!device || !stats || size != sizeof(*stats))
+		return -1;
+
+	memcpy(stats, &device->emulation, sizeof(*stats));
+	return 0;
+}
+
+static void export_state(const struct ds5_sample *sample, unsigned int seq,
+			 struct ds5vita_state *out)
+{
+	const struct ds5_state *state = &sample->state;
+	unsigned int i;
+
+	memset(out, 0, sizeof(*out));
+	out->seq = seq;
+	out->timestamp = sample->timestamp;
+	out->buttons = state->buttons;
+	out->lx = state->lx;
+	out->ly = state->ly;
+	out->rx = state->rx;
+	out->ry = state->ry;
+	out->lt = state->lt;
+	out->rt = state->rt;
+	out->battery_level = state->battery_level;
+	out->usb_plugged = state->usb_plugged;
+	out->report_seq = state->seq;
+
+	for (i = 0; i < 3; i++) {
+		out->accel[i] = state->accel[i];
+		out->gyro[i] = state->gyro[i];
+	}
+
+	for (i = 0; i < 2; i++) {
+		out->finger[i].id = state->finger[i].id;
+		out->finger[i].active = state->finger[i].active;
+		out->finger[i].x = state->finger[i].x;
+		out->finger[i].y = state->finger[i].y;
+	}
+}
+
+/*
+ * The seq handed out is the history index of the sample plus one, so an
+ * unchanged state costs the syscall and one load, and nothing is copied.
+ * The history restarts with each connection, so the connection generation
+ * goes in the high bits and a seq from a previous one never matches.
+ */
+#define DS5_SEQ_HEAD_BITS 20
+
+static inline unsigned int state_seq(const struct ds5_device *device, unsigned int head)
+{
+	return (device->generation << DS5_SEQ_HEAD_BITS) |
+	       (head & ((1 << DS5_SEQ_HEAD_BITS) - 1));
+}
+
+int ds5vitaGetState(unsigned int port, struct ds5vita_state *state, unsigned int size,
+		    unsigned int seq)
+{
+	struct ds5_device *device;
+	struct ds5_sample sample;
+	struct ds5vita_state k_state;
+	unsigned int head;
+	int ret, syscall_state;
+
+	ENTER_SYSCALL(syscall_state);
+
+	device = ds5_device_by_port(port);
+	if (!device || !state || size != sizeof(k_state)) {
+		ret = -1;
+		goto out;
+	}
+
+	/* Only fails if the writer lapped the whole ring meanwhile */
+	do {
+		head = ds5_history_head(&device->history);
+		if (head == 0 || state_seq(device, head) == seq) {
+			ret = 0;
+			goto out;
+		}
+	} while (ds5_history_get(&device->history, head - 1, &sample) < 0);
+
+	export_state(&sample, state_seq(device, head), &k_state);
+	ksceKernelMemcpyKernelToUser((uintptr_t)state, &k_state, sizeof(k_state));
+	ret = 1;
+
+out:
+	EXIT_SYSCALL(syscall_state);
+	return ret;
+}
+
+/* The BT thread sends it once the rate limit allows */
+int ds5vitaSetRumble(unsigned int port, unsigned char right, unsigned char left)
+{
+	struct ds5_device *device;
+	int ret = -1, syscall_state;
+
+	ENTER_SYSCALL(syscall_state);
+
+	device = ds5_device_by_port(port);
+	if (device) {
+		ds5_output_set_rumble(&device->output, right, left);
+		ksceKernelSetEventFlag(bt_evf_uid, BT_EVF_OUTPUT);
+		ret = 0;
+	}
+
+	EXIT_SYSCALL(syscall_state);
+	return ret;
+}
+
+int ds5vitaSetLightBar(unsigned int port, unsigned char r, unsigned char g, unsigned char b)
+{
+	struct ds5_device *device;
+	int ret = -1, syscall_state;
+
+	ENTER_SYSCALL(syscall_state);
+
+	device = ds5_device_by_port(port);
+	if (device) {
+		ds5_output_set_lightbar(&device->output, r, g, b, 0xFF, 0x00);
+		ksceKernelSetEventFlag(bt_evf_uid, BT_EVF_OUTPUT);
+		ret = 0;
 	}
 
+	EXIT_SYSCALL(syscall_state);
+	return ret;
+}
+
+int ds5vitaGetOutputStats(unsigned int port, struct ds5vita_output_stats *stats,
+			  unsigned int size)
+{
+	struct ds5_device *device = ds5_device_by_port(port);
+
+	if (!device || !stats || size != sizeof(*stats))
+		return -1;
+
+	stats->requested = device->output.requested;
+	stats->reports = device->output.reports;
+	stats->unchanged = device->output.unchanged;
+	stats->deferred = device->output.deferred;
+	return 0;
+}
+
+static void log_device_stats(const struct ds5_device *device)
+{
+#ifndef RELEASE
+	const struct ds5vita_link_stats *link = &device->link.stats;
+	const struct ds5vita_emulation_stats *emulation = &device->emulation;
+
+	LOG("Port %u: dropped %u corrupt DS5 reports, %u reads completed out of order\n",
+		device->port, device->crc_errors, device->read_skips);
+	LOG("Port %u output: %u requested, %u reports, %u unchanged, %u deferred\n",
+		device->port, device->output.requested, device->output.reports,
+		device->output.unchanged, device->output.deferred);
+	LOG("Port %u link: %u received, %u lost in %u gaps, %u duplicates, %u out of order\n",
+		device->port, link->received, link->lost, link->gaps,
+		link->duplicates, link->out_of_order);
+	LOG("Port %u link: %u us mean interval, %u us jitter, %u us max\n",
+		device->port, link->interval, link->jitter, link->interval_max);
+	LOG("Port %u dirty: %u reports, buttons %u, analog %u, touch %u, motion %u, battery %u\n",
+		device->port, emulation->reports,
+		emulation->dirty[DS5VITA_SUBSYSTEM_BUTTONS],
+		emulation->dirty[DS5VITA_SUBSYSTEM_ANALOG],
+		emulation->dirty[DS5VITA_SUBSYSTEM_TOUCH],
+		emulation->dirty[DS5VITA_SUBSYSTEM_MOTION],
+		emulation->dirty[DS5VITA_SUBSYSTEM_BATTERY]);
+	LOG("Port %u emulation: %u kernel calls, %u skipped\n",
+		device->port, emulation->calls, emulation->skipped);
+#endif
+}
+
+static void remember_reconnect(unsigned int mac0, unsigned int mac1)
+{
+	unsigned int i;
+
+	for (i = 0; i < reconnect_count; i++) {
+		if (reconnect_macs[i][0] == mac0 && reconnect_macs[i][1] == mac1)
+			return;
+	}
+
+	if (reconnect_count < DS5_MAX_DEVICES) {
+		reconnect_macs[reconnect_count][0] = mac0;
+		reconnect_macs[reconnect_count][1] = mac1;
+		reconnect_count++;
+	}
+}
+
+/* The links do not survive a suspend, drop them cleanly before it */
+static void ds5_suspend(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < DS5_MAX_DEVICES; i++) {
+		struct ds5_device *device = &ds5_devices[i];
+
+		if (!device->connected)
+			continue;
+
+		remember_reconnect(device->mac0, device->mac1);
+		ksceBtStartDisconnect(device->mac0, device->mac1);
+		ds5_disconnect(device);
+	}
+}
+
+/*
+ * Pages the remembered controllers rather than waiting for the PS button.
+ * The reads are posted again by the usual connect path.
+ */
+static void ds5_reconnect(void)
+{
+	unsigned long long now = ksceKernelGetSystemTimeWide();
+	unsigned int i;
+
+	if (reconnect_count == 0)
+		return;
+
+	reconnect_paged_count = 0;
+
+	for (i = 0; i < reconnect_count; i++) {
+		struct reconnect_page *page = &reconnect_paged[reconnect_paged_count];
+
+		if (ds5_device_find(reconnect_macs[i][0], reconnect_macs[i][1]))
+			continue;
+
+		/* Recorded first, the connect event may beat the return */
+		page->mac0 = reconnect_macs[i][0];
+		page->mac1 = reconnect_macs[i][1];
+		page->start = now;
+		reconnect_paged_count++;
+
+		if (ksceBtStartConnect(page->mac0, page->mac1) < 0)
+			reconnect_paged_count--;
+	}
+
+	LOG("Paged %u of %u controllers\n", reconnect_paged_count, reconnect_count);
+	reconnect_count = 0;
+}
+
+/* Runs in the suspend path, the work is left to the BT thread */
+static int ds5_sysevent_handler(int resume, int eventid, void *args, void *opt)
+{
+	if (!resume && eventid == DS5_SYSEVENT_SUSPEND)
+		ksceKernelSetEventFlag(bt_evf_uid, BT_EVF_SUSPEND);
+	else if (resume && eventid == DS5_SYSEVENT_RESUME)
+		ksceKernelSetEventFlag(bt_evf_uid, BT_EVF_RESUME);
+
 	return 0;
 }
 
 static int ds5vita_bt_thread(SceSize args, void *argp)
 {
+	unsigned int i;
+
 	bt_cb_uid = ksceKernelCreateCallback("ds5vita_bt_callback", 0, bt_cb_func, NULL);
 
 	ksceBtRegisterCallback(bt_cb_uid, 0, 0xFFFFFFFF, 0xFFFFFFFF);
 
+	if (ds5_pairing_load(&pairing_mac0, &pairing_mac1) == 0) {
+		remember_reconnect(pairing_mac0, pairing_mac1);
+		ds5_reconnect();
+	}
+
 /*#ifndef RELEASE
 	ksceBtStartInquiry();
 	ksceKernelDelayThreadCB(4 * 1000 * 1000);
 	ksceBtStopInquiry();
 #endif*/
 
-	while (bt_thread_run) {
-		ksceKernelDelayThreadCB(200 * 1000);
+	/*
+	 * Sleeps until module_stop, or until a deferred output report is due.
+	 * The BT callback runs from within the wait.
+	 */
+	while (1) {
+		unsigned int due = output_due();
+		unsigned int bits = 0;
+		SceUInt timeout = due;
+
+		ksceKernelWaitEventFlagCB(bt_evf_uid,
+			BT_EVF_OUTPUT | BT_EVF_STOP | BT_EVF_SUSPEND | BT_EVF_RESUME,
+			SCE_EVENT_WAITOR | SCE_EVENT_WAITCLEAR_PAT, &bits,
+			due == DS5_OUTPUT_IDLE ? NULL : &timeout);
+		bt_wakeups++;
+
+		if (bits & BT_EVF_STOP)
+			break;
+
+		/* Both may be set if the thread did not run before the system slept */
+		if (bits & BT_EVF_SUSPEND)
+			ds5_suspend();
+		if (bits & BT_EVF_RESUME)
+			ds5_reconnect();
+
+		for (i = 0; i < DS5_MAX_DEVICES; i++)
+			ds5_output_pump(&ds5_devices[i]);
 	}
 
-	if (ds5_connected) {
-		ksceBtStartDisconnect(ds5_mac0, ds5_mac1);
-		reset_input_emulation();
+	LOG("BT thread: %u wakeups\n", bt_wakeups);
+	log_latency_stats();
+
+	for (i = 0; i < DS5_MAX_DEVICES; i++) {
+		struct ds5_device *device = &ds5_devices[i];
+
+		if (!device->connected)
+			continue;
+
+		log_device_stats(device);
+
+		ksceBtStartDisconnect(device->mac0, device->mac1);
+		ds5_disconnect(device);
 	}
 
 	ksceBtUnregisterCallback(bt_cb_uid);
@@ -660,25 +1546,23 @@ void _start() __attribute__ ((weak, alias ("module_start")));
 	name##_hook_uid = taiHookFunctionExportForKernel((pid), \
 		&name##_ref, (module), (lib_nid), (func_nid), name##_hook_func)
 
-int module_start(SceSize argc, const void *args)
-{
-	int ret;
-	tai_module_info_t SceBt_modinfo;
-
-	log_reset();
-
-	LOG("ds5vita by hedhehd\n");
-
-	SceBt_modinfo.size = sizeof(SceBt_modinfo);
-	ret = taiGetModuleInfoForKernel(KERNEL_PID, "SceBt", &SceBt_modinfo);
-	if (ret < 0) {
-		LOG("Error finding SceBt module\n");
-		goto error_find_scebt;
-	}
+#define UNBIND_FUNC_HOOK(name) \
+	do { \
+		if (name##_hook_uid > 0) { \
+			taiHookReleaseForKernel(name##_hook_uid, name##_ref); \
+			name##_hook_uid = -1; \
+		} \
+	} while(0)
 
-	/* SceBt hooks */
-	BIND_FUNC_OFFSET_HOOK(SceBt_sub_22999C8, KERNEL_PID,
-		SceBt_modinfo.modid, 0, 0x22999C8 - 0x2280000, 1);
+/*
+ * The input paths are hooked on the first connect, so games and the shell
+ * pay nothing until a controller shows up. From then on every call goes
+ * through the hooks, which just pass through with no controller connected.
+ */
+static void input_hooks_attach(void)
+{
+	if (input_hooks_attached)
+		return;
 
 	/* Patch PAD Type */
 	BIND_FUNC_EXPORT_HOOK(SceCtrl_ksceCtrlGetControllerPortInfo, KERNEL_PID,
@@ -718,6 +1602,86 @@ int module_start(SceSize argc, const void *args)
 	BIND_FUNC_EXPORT_HOOK(SceMotion_sceMotionGetState, KERNEL_PID,
 		"SceMotion", TAI_ANY_LIBRARY, 0xBDB32767);
 
+	input_hooks_attached = 1;
+	LOG("Input hooks attached\n");
+}
+
+/*
+ * A caller can already be in a hook when it is released, and releasing
+ * frees the ref its TAI_CONTINUE goes through. Nothing in a hook can close
+ * that window without taxing every input call, so the hooks are never
+ * released while controllers come and go. Only module_stop releases them.
+ */
+static void input_hooks_detach(void)
+{
+	if (!input_hooks_attached)
+		return;
+
+	UNBIND_FUNC_HOOK(SceCtrl_ksceCtrlGetControllerPortInfo);
+	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlGetBatteryInfo);
+	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlPeekBufferPositive2);
+	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlReadBufferPositive2);
+	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlPeekBufferPositiveExt2);
+	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlReadBufferPositiveExt2);
+	UNBIND_FUNC_HOOK(SceTouch_ksceTouchPeek);
+	UNBIND_FUNC_HOOK(SceTouch_ksceTouchPeekRegion);
+	UNBIND_FUNC_HOOK(SceTouch_ksceTouchRead);
+	UNBIND_FUNC_HOOK(SceTouch_ksceTouchReadRegion);
+	UNBIND_FUNC_HOOK(SceMotion_sceMotionGetState);
+
+	input_hooks_attached = 0;
+	LOG("Input hooks released\n");
+}
+
+/* Compiles the config into the decoder tables and the touch map */
+static void load_config(void)
+{
+	struct ds5_config config;
+	int ret;
+
+	ret = ds5_config_load(&config, DS5_CONFIG_FILE);
+	if (ret >= 0)
+		LOG("Loaded " DS5_CONFIG_FILE ", %d lines ignored\n", ret);
+
+	ds5_report_set_remap(&config.remap, &config.analog);
+	predict_ahead = config.predict;
+	if (predict_ahead)
+		LOG("Extrapolating sticks and triggers up to %u us ahead\n", predict_ahead);
+	output_rate = config.output_rate;
+
+	if (ds5_touch_map_init(&touch_map, config.zones, config.num_zones) < 0) {
+		LOG("Invalid touch zones, using the whole front screen\n");
+		ds5_touch_map_init(&touch_map, ds5_touch_zones_front, 1);
+	}
+}
+
+int module_start(SceSize argc, const void *args)
+{
+	int ret;
+	tai_module_info_t SceBt_modinfo;
+
+	log_reset();
+	log_start();
+
+	if (ds5_capture_start() > 0)
+		LOG("Capturing to " DS5_CAPTURE_FILE "\n");
+
+	crc32_init();
+	load_config();
+
+	LOG("ds5vita by hedhehd\n");
+
+	SceBt_modinfo.size = sizeof(SceBt_modinfo);
+	ret = taiGetModuleInfoForKernel(KERNEL_PID, "SceBt", &SceBt_modinfo);
+	if (ret < 0) {
+		LOG("Error finding SceBt module\n");
+		goto error_find_scebt;
+	}
+
+	/* SceBt hooks */
+	BIND_FUNC_OFFSET_HOOK(SceBt_sub_22999C8, KERNEL_PID,
+		SceBt_modinfo.modid, 0, 0x22999C8 - 0x2280000, 1);
+
 	SceKernelHeapCreateOpt opt;
 	opt.size = 0x1C;
 	opt.uselock = 0x100;
@@ -727,9 +1691,26 @@ int module_start(SceSize argc, const void *args)
 	opt.field_14 = 0;
 	opt.field_18 = 0;
 
-	bt_mempool_uid = ksceKernelCreateHeap("ds5vita_mempool", 0x100, &opt);
+	bt_mempool_uid = ksceKernelCreateHeap("ds5vita_mempool",
+		0x100 + DS5_REQ_POOL_SIZE * sizeof(struct ds5_req_slot), &opt);
 	LOG("Bluetooth mempool UID: 0x%08X\n", bt_mempool_uid);
 
+	if (bt_mempool_uid > 0 && ds5_req_pool_init(&req_pool, bt_mempool_uid) < 0)
+		LOG("Error allocating BT HID Request pool\n");
+
+	bt_evf_uid = ksceKernelCreateEventFlag("ds5vita_bt_evf", 0, 0, NULL);
+	LOG("Bluetooth event flag UID: 0x%08X\n", bt_evf_uid);
+
+	/* The BT thread would spin on a failing wait and never see the stop */
+	if (bt_evf_uid < 0) {
+		LOG("Error creating the BT event flag\n");
+		goto error_create_evf;
+	}
+
+	sysevent_uid = ksceKernelRegisterSysEventHandler("ds5vita_sysevent",
+		ds5_sysevent_handler, NULL);
+	LOG("Sysevent handler UID: 0x%08X\n", sysevent_uid);
+
 	bt_thread_uid = ksceKernelCreateThread("ds5vita_bt_thread", ds5vita_bt_thread,
 		0x3C, 0x1000, 0, 0x10000, 0);
 	LOG("Bluetooth thread UID: 0x%08X\n", bt_thread_uid);
@@ -739,45 +1720,60 @@ int module_start(SceSize argc, const void *args)
 
 	return SCE_KERNEL_START_SUCCESS;
 
+error_create_evf:
+	if (bt_mempool_uid > 0) {
+		ds5_req_pool_fini(&req_pool, bt_mempool_uid);
+		ksceKernelDeleteHeap(bt_mempool_uid);
+		bt_mempool_uid = -1;
+	}
+	UNBIND_FUNC_HOOK(SceBt_sub_22999C8);
 error_find_scebt:
 	return SCE_KERNEL_START_FAILED;
 }
 
-#define UNBIND_FUNC_HOOK(name) \
-	do { \
-		if (name##_hook_uid > 0) { \
-			taiHookReleaseForKernel(name##_hook_uid, name##_ref); \
-		} \
-	} while(0)
 
 int module_stop(SceSize argc, const void *args)
 {
-	SceUInt timeout = 0xFFFFFFFF;
+	SceUInt timeout = DS5_BT_STOP_TIMEOUT;
+
+	if (sysevent_uid >= 0) {
+		ksceKernelUnregisterSysEventHandler(sysevent_uid);
+		sysevent_uid = -1;
+	}
 
 	if (bt_thread_uid > 0) {
-		bt_thread_run = 0;
-		ksceKernelWaitThreadEnd(bt_thread_uid, NULL, &timeout);
+		ksceKernelSetEventFlag(bt_evf_uid, BT_EVF_STOP);
+		if (ksceKernelWaitThreadEnd(bt_thread_uid, NULL, &timeout) < 0) {
+			/* Still running our code, unloading now would pull it from under it */
+			LOG("BT thread did not exit, not stopping\n");
+			return SCE_KERNEL_STOP_FAIL;
+		}
 		ksceKernelDeleteThread(bt_thread_uid);
+		bt_thread_uid = -1;
+	}
+
+	if (bt_evf_uid >= 0) {
+		ksceKernelDeleteEventFlag(bt_evf_uid);
+		bt_evf_uid = -1;
+	}
+
+	if (ds5_capture_stop() < 0) {
+		LOG("Capture thread did not exit, not stopping\n");
+		return SCE_KERNEL_STOP_FAIL;
 	}
 
 	if (bt_mempool_uid > 0) {
+		LOG("BT HID Request pool: %u sent, %u exhausted\n",
+			req_pool.acquired, req_pool.exhausted);
+		ds5_req_pool_fini(&req_pool, bt_mempool_uid);
 		ksceKernelDeleteHeap(bt_mempool_uid);
 	}
 
 	UNBIND_FUNC_HOOK(SceBt_sub_22999C8);
-	UNBIND_FUNC_HOOK(SceCtrl_ksceCtrlGetControllerPortInfo);
-	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlGetBatteryInfo);
-	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlPeekBufferPositive2);
-	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlReadBufferPositive2);
-	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlPeekBufferPositiveExt2);
-	UNBIND_FUNC_HOOK(SceCtrl_sceCtrlReadBufferPositiveExt2);
-	UNBIND_FUNC_HOOK(SceTouch_ksceTouchPeek);
-	UNBIND_FUNC_HOOK(SceTouch_ksceTouchPeekRegion);
-	UNBIND_FUNC_HOOK(SceTouch_ksceTouchRead);
-	UNBIND_FUNC_HOOK(SceTouch_ksceTouchReadRegion);
-	UNBIND_FUNC_HOOK(SceMotion_sceMotionGetState);
+	input_hooks_detach();
 
-	log_flush();
+	if (log_stop() < 0)
+		return SCE_KERNEL_STOP_FAIL;
 
 	return SCE_KERNEL_STOP_SUCCESS;
 }
\ No newline at end of file
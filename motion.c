@@ -0,0 +1,259 @@
+#include <string.h>
+#include "motion.h"
+
+/* dmb on ARMv7 SMP, keeps the payload copies inside the seq updates */
+#define barrier() __sync_synchronize()
+
+#define Q30 (1 << 30)
+
+/* Feedback gains, Q16. Higher proportional gain while settling after connect */
+#define KP       (65536 / 2)
+#define KP_FAST  (65536 * 8)
+#define KI       (65536 / 64)
+#define SETTLE_UPDATES 250
+
+/* Longest step integrated, a stall must not spin the estimate */
+#define MAX_DT_US 50000
+
+/* At rest: every gyro axis this close to its bias, for this many updates */
+#define STILL_LSB     48
+#define STILL_UPDATES 64
+
+static inline int mul30(int a, int b)
+{
+	return ((long long)a * b) >> 30;
+}
+
+static unsigned int isqrt32(unsigned int x)
+{
+	unsigned int root = 0, bit = 1u << 30;
+
+	while (bit > x)
+		bit >>= 2;
+
+	while (bit) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return root;
+}
+
+static inline int iabs(int x)
+{
+	return x < 0 ? -x : x;
+}
+
+void ds5_motion_calib_default(struct ds5_motion_calib *calib)
+{
+	int i;
+
+	memset(calib, 0, sizeof(*calib));
+
+	for (i = 0; i < 3; i++) {
+		calib->gyro_scale[i] = DS5_MOTION_GYRO_SCALE;
+		calib->accel_res[i] = DS5_MOTION_ACCEL_RES;
+	}
+}
+
+void ds5_motion_init(struct ds5_motion *motion)
+{
+	memset(motion, 0, sizeof(*motion));
+	ds5_motion_calib_default(&motion->calib);
+
+	motion->q[0] = Q30;
+	motion->sample.quat[3] = 1.0f;
+	motion->sample.matrix[0][0] = 1.0f;
+	motion->sample.matrix[1][1] = 1.0f;
+	motion->sample.matrix[2][2] = 1.0f;
+}
+
+/* The rest bias was measured against the old calibration, start it over */
+void ds5_motion_set_calib(struct ds5_motion *motion, const struct ds5_motion_calib *calib)
+{
+	memcpy(&motion->calib, calib, sizeof(*calib));
+	memset(motion->rest_bias, 0, sizeof(motion->rest_bias));
+	motion->still = 0;
+}
+
+/* Rescaled to the nominal resolution, clamped so the squares stay in range */
+static inline int calib_accel(const struct ds5_motion_calib *calib, const signed short accel[3],
+			      int i)
+{
+	int a = (accel[i] - calib->accel_bias[i]) * DS5_MOTION_ACCEL_RES / calib->accel_res[i];
+
+	return a < -32768 ? -32768 : (a > 32767 ? 32767 : a);
+}
+
+/*
+ * Slowly tracks the gyro bias while the controller lies still, which is
+ * what the per-unit factory bias drifts away from with temperature.
+ */
+static void track_rest_bias(struct ds5_motion *motion, const int g[3], unsigned int accel_sq,
+			    unsigned int res_sq)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (iabs(g[i] - (motion->rest_bias[i] >> 8)) > STILL_LSB)
+			break;
+	}
+
+	/* Within about 5% of 1 g */
+	if (i < 3 || accel_sq < res_sq - res_sq / 10 || accel_sq > res_sq + res_sq / 10) {
+		motion->still = 0;
+		return;
+	}
+
+	if (++motion->still < STILL_UPDATES)
+		return;
+
+	for (i = 0; i < 3; i++)
+		motion->rest_bias[i] += ((g[i] << 8) - motion->rest_bias[i]) >> 6;
+}
+
+static void publish(struct ds5_motion *motion, const int a[3], const int g_q16[3],
+		    unsigned long long timestamp)
+{
+	const int *q = motion->q;
+	struct ds5_motion_sample *s = &motion->sample;
+	float w = q[0] * (1.0f / Q30), x = q[1] * (1.0f / Q30);
+	float y = q[2] * (1.0f / Q30), z = q[3] * (1.0f / Q30);
+	int i;
+
+	motion->seq++;
+	barrier();
+
+	s->timestamp = timestamp;
+
+	/* SceMotion reports the gravity vector, the controller the reaction to it */
+	for (i = 0; i < 3; i++) {
+		s->accel[i] = -a[i] * (1.0f / DS5_MOTION_ACCEL_RES);
+		s->gyro[i] = g_q16[i] * (1.0f / 65536);
+	}
+
+	s->quat[0] = x;
+	s->quat[1] = y;
+	s->quat[2] = z;
+	s->quat[3] = w;
+
+	s->matrix[0][0] = 1 - 2 * (y * y + z * z);
+	s->matrix[0][1] = 2 * (x * y - w * z);
+	s->matrix[0][2] = 2 * (x * z + w * y);
+	s->matrix[1][0] = 2 * (x * y + w * z);
+	s->matrix[1][1] = 1 - 2 * (x * x + z * z);
+	s->matrix[1][2] = 2 * (y * z - w * x);
+	s->matrix[2][0] = 2 * (x * z - w * y);
+	s->matrix[2][1] = 2 * (y * z + w * x);
+	s->matrix[2][2] = 1 - 2 * (x * x + y * y);
+
+	barrier();
+	motion->seq++;
+}
+
+void ds5_motion_update(struct ds5_motion *motion, const signed short accel[3],
+		       const signed short gyro[3], unsigned long long timestamp)
+{
+	const struct ds5_motion_calib *calib = &motion->calib;
+	int raw_g[3], a[3], g[3], g_q16[3], w_q16[3], d[3];
+	int *q = motion->q;
+	unsigned int dt, accel_sq, res_sq;
+	long long n2;
+	int i, k;
+
+	dt = motion->updates == 0 ? 0 :
+		(timestamp - motion->last > MAX_DT_US ? MAX_DT_US : timestamp - motion->last);
+	motion->last = timestamp;
+	motion->updates++;
+
+	for (i = 0; i < 3; i++)
+		raw_g[i] = gyro[i] - calib->gyro_bias[i];
+
+	/*
+	 * Controller axes (x right, y out of the face, z towards the player)
+	 * to the Vita's (x right, y up the screen, z out of the screen).
+	 */
+	a[0] = calib_accel(calib, accel, 0);
+	a[1] = -calib_accel(calib, accel, 2);
+	a[2] = calib_accel(calib, accel, 1);
+
+	/* Up to 3 * 2^30 at full scale, past INT_MAX */
+	accel_sq = (unsigned int)(a[0] * a[0]) + (unsigned int)(a[1] * a[1]) +
+		(unsigned int)(a[2] * a[2]);
+	res_sq = DS5_MOTION_ACCEL_RES * DS5_MOTION_ACCEL_RES;
+	track_rest_bias(motion, raw_g, accel_sq, res_sq);
+
+	for (i = 0; i < 3; i++) {
+		raw_g[i] -= motion->rest_bias[i] >> 8;
+		g[i] = ((long long)raw_g[i] * calib->gyro_scale[i]) >> 16;
+	}
+
+	g_q16[0] = w_q16[0] = g[0];
+	g_q16[1] = w_q16[1] = -g[2];
+	g_q16[2] = w_q16[2] = g[1];
+
+	/* Correct towards gravity unless the controller is being shaken */
+	if (accel_sq > res_sq / 2 && accel_sq < res_sq * 3 / 2) {
+		int inv = Q30 / isqrt32(accel_sq);
+		int ax = a[0] * inv, ay = a[1] * inv, az = a[2] * inv;
+		int vx = 2 * (mul30(q[1], q[3]) - mul30(q[0], q[2]));
+		int vy = 2 * (mul30(q[0], q[1]) + mul30(q[2], q[3]));
+		int vz = mul30(q[0], q[0]) - mul30(q[1], q[1]) -
+			mul30(q[2], q[2]) + mul30(q[3], q[3]);
+		int kp = motion->updates < SETTLE_UPDATES ? KP_FAST : KP;
+		int e[3];
+
+		e[0] = ((long long)mul30(ay, vz) - mul30(az, vy)) >> 14;
+		e[1] = ((long long)mul30(az, vx) - mul30(ax, vz)) >> 14;
+		e[2] = ((long long)mul30(ax, vy) - mul30(ay, vx)) >> 14;
+
+		for (i = 0; i < 3; i++) {
+			/* dt / 10^6 as a Q32 multiply */
+			motion->e_int[i] += ((long long)e[i] * KI >> 16) * dt * 4295 >> 32;
+			g_q16[i] += ((long long)e[i] * kp >> 16) + motion->e_int[i];
+		}
+	}
+
+	/* Rotation over the step in radians Q30, 2^14 / 10^6 as a Q32 multiply */
+	for (i = 0; i < 3; i++)
+		d[i] = ((long long)g_q16[i] * dt * 70368744) >> 32;
+
+	{
+		int w = q[0], x = q[1], y = q[2], z = q[3];
+
+		/* q += q * (0, d) / 2 */
+		q[0] -= ((long long)x * d[0] + (long long)y * d[1] + (long long)z * d[2]) >> 31;
+		q[1] += ((long long)w * d[0] + (long long)y * d[2] - (long long)z * d[1]) >> 31;
+		q[2] += ((long long)w * d[1] - (long long)x * d[2] + (long long)z * d[0]) >> 31;
+		q[3] += ((long long)w * d[2] + (long long)x * d[1] - (long long)y * d[0]) >> 31;
+	}
+
+	/* |q| stays close to 1, so one Newton step renormalizes: q *= (3 - |q|^2) / 2 */
+	n2 = ((long long)q[0] * q[0] + (long long)q[1] * q[1] +
+	      (long long)q[2] * q[2] + (long long)q[3] * q[3]) >> 30;
+	k = (3LL * Q30 - n2) >> 1;
+	for (i = 0; i < 4; i++)
+		q[i] = mul30(q[i], k);
+
+	/* The measured rate goes out, not the corrected one */
+	publish(motion, a, w_q16, timestamp);
+}
+
+void ds5_motion_read(const struct ds5_motion *motion, struct ds5_motion_sample *sample)
+{
+	unsigned int seq;
+
+	do {
+		seq = motion->seq;
+		barrier();
+
+		memcpy(sample, &motion->sample, sizeof(*sample));
+
+		barrier();
+	} while ((seq & 1) || seq != motion->seq);
+}
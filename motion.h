@@ -0,0 +1,50 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+/* Nominal sensor resolutions, used until the controller's calibration is read */
+#define DS5_MOTION_ACCEL_RES 8192    /* LSB per g */
+#define DS5_MOTION_GYRO_SCALE 4575276 /* rad/s per LSB in Q32, 16.384 LSB per deg/s */
+
+/* Sensor calibration, in raw controller units and axes */
+struct ds5_motion_calib {
+	short gyro_bias[3];
+	short accel_bias[3];
+	int gyro_scale[3];  /* rad/s per LSB, Q32 */
+	int accel_res[3];   /* LSB per g */
+};
+
+/* What the SceMotion hook publishes, in the Vita's axes and units */
+struct ds5_motion_sample {
+	unsigned long long timestamp;
+	float accel[3];  /* g */
+	float gyro[3];   /* rad/s */
+	float quat[4];   /* x y z w */
+	float matrix[3][3];
+};
+
+/*
+ * Mahony style orientation filter in fixed point, stepped once per input
+ * report by the BT thread. The result is published as floats behind a
+ * sequence counter so the hooks only copy it.
+ */
+struct ds5_motion {
+	struct ds5_motion_calib calib;
+	int q[4];              /* w x y z, Q30 */
+	int e_int[3];          /* integral feedback, rad/s Q16 */
+	int rest_bias[3];      /* gyro drift measured at rest, LSB Q8 */
+	unsigned int still;    /* consecutive updates at rest */
+	unsigned int updates;
+	unsigned long long last;
+
+	volatile unsigned int seq;
+	struct ds5_motion_sample sample;
+};
+
+void ds5_motion_init(struct ds5_motion *motion);
+void ds5_motion_calib_default(struct ds5_motion_calib *calib);
+void ds5_motion_set_calib(struct ds5_motion *motion, const struct ds5_motion_calib *calib);
+void ds5_motion_update(struct ds5_motion *motion, const signed short accel[3],
+		       const signed short gyro[3], unsigned long long timestamp);
+void ds5_motion_read(const struct ds5_motion *motion, struct ds5_motion_sample *sample);
+
+#endif
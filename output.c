@@ -0,0 +1,108 @@
+#include <string.h>
+#include "output.h"
+
+void ds5_output_init(struct ds5_output *out, unsigned int max_rate_hz)
+{
+	memset(out, 0, sizeof(*out));
+	out->min_interval = 1000000 / max_rate_hz;
+}
+
+void ds5_output_set_rumble(struct ds5_output *out, unsigned char right, unsigned char left)
+{
+	out->rumble = right | (left << 8);
+	__sync_fetch_and_or(&out->dirty, DS5_OUTPUT_RUMBLE);
+	__sync_fetch_and_add(&out->requested, 1);
+}
+
+void ds5_output_set_lightbar(struct ds5_output *out, unsigned char r, unsigned char g,
+			     unsigned char b, unsigned char blink_on, unsigned char blink_off)
+{
+	unsigned int misc;
+
+	out->lightbar = r | (g << 8) | (b << 16);
+
+	do {
+		misc = out->misc;
+	} while (!__sync_bool_compare_and_swap(&out->misc, misc,
+		(misc & 0xFF0000) | blink_on | (blink_off << 8)));
+
+	__sync_fetch_and_or(&out->dirty, DS5_OUTPUT_LIGHTBAR);
+	__sync_fetch_and_add(&out->requested, 1);
+}
+
+void ds5_output_set_player_leds(struct ds5_output *out, unsigned char leds)
+{
+	unsigned int misc;
+
+	do {
+		misc = out->misc;
+	} while (!__sync_bool_compare_and_swap(&out->misc, misc,
+		(misc & 0xFFFF) | (leds << 16)));
+
+	__sync_fetch_and_or(&out->dirty, DS5_OUTPUT_LEDS);
+	__sync_fetch_and_add(&out->requested, 1);
+}
+
+/*
+ * Returns 1 and fills state if a report has to be sent now, 0 if there
+ * is nothing new or the rate limit defers it to a later call.
+ */
+int ds5_output_take(struct ds5_output *out, unsigned long long now,
+		    struct ds5_output_state *state)
+{
+	unsigned int rumble, lightbar, misc;
+
+	if (!out->dirty)
+		return 0;
+
+	if (out->has_sent && now - out->last_send < out->min_interval) {
+		out->deferred++;
+		return 0;
+	}
+
+	/* Clear first, a setter racing with us re-marks its group */
+	__sync_lock_test_and_set(&out->dirty, 0);
+
+	rumble = out->rumble;
+	lightbar = out->lightbar;
+	misc = out->misc;
+
+	state->motor_right = rumble;
+	state->motor_left = rumble >> 8;
+	state->r = lightbar;
+	state->g = lightbar >> 8;
+	state->b = lightbar >> 16;
+	state->blink_on = misc;
+	state->blink_off = misc >> 8;
+	state->player_leds = misc >> 16;
+
+	if (out->has_sent && !memcmp(state, &out->sent, sizeof(*state))) {
+		out->unchanged++;
+		return 0;
+	}
+
+	memcpy(&out->sent, state, sizeof(*state));
+	out->has_sent = 1;
+	out->last_send = now;
+	out->reports++;
+
+	return 1;
+}
+
+/*
+ * Microseconds until ds5_output_take() would send the pending changes,
+ * 0 if it would right now, DS5_OUTPUT_IDLE if there are none.
+ */
+unsigned int ds5_output_due(const struct ds5_output *out, unsigned long long now)
+{
+	unsigned long long elapsed;
+
+	if (!out->dirty)
+		return DS5_OUTPUT_IDLE;
+
+	if (!out->has_sent)
+		return 0;
+
+	elapsed = now - out->last_send;
+	return elapsed >= out->min_interval ? 0 : out->min_interval - elapsed;
+}
@@ -0,0 +1,60 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/* Output reports per second, unless config.txt sets output_rate */
+#define DS5_OUTPUT_MAX_RATE_HZ 100
+#define DS5_OUTPUT_RATE_LIMIT_HZ 250 /* highest output_rate accepted */
+
+#define DS5_OUTPUT_RUMBLE   (1 << 0)
+#define DS5_OUTPUT_LIGHTBAR (1 << 1)
+#define DS5_OUTPUT_LEDS     (1 << 2)
+
+struct ds5_output_state {
+	unsigned char motor_right;
+	unsigned char motor_left;
+	unsigned char r;
+	unsigned char g;
+	unsigned char b;
+	unsigned char blink_on;
+	unsigned char blink_off;
+	unsigned char player_leds;
+};
+
+/*
+ * Output report scheduler. The setters can be called from any context:
+ * each group of fields is a single word store plus a dirty bit, so
+ * repeated changes between two sends simply overwrite each other.
+ * The BT thread calls ds5_output_take() to get at most one merged
+ * report per min_interval, and nothing if the state did not change.
+ */
+struct ds5_output {
+	volatile unsigned int dirty;
+	volatile unsigned int rumble;   /* right | left << 8 */
+	volatile unsigned int lightbar; /* r | g << 8 | b << 16 */
+	volatile unsigned int misc;     /* blink_on | blink_off << 8 | player_leds << 16 */
+
+	struct ds5_output_state sent;
+	int has_sent;
+	unsigned long long last_send;
+	unsigned int min_interval;
+
+	volatile unsigned int requested;
+	unsigned int reports;
+	unsigned int unchanged;
+	unsigned int deferred;
+};
+
+void ds5_output_init(struct ds5_output *out, unsigned int max_rate_hz);
+void ds5_output_set_rumble(struct ds5_output *out, unsigned char right, unsigned char left);
+void ds5_output_set_lightbar(struct ds5_output *out, unsigned char r, unsigned char g,
+			     unsigned char b, unsigned char blink_on, unsigned char blink_off);
+void ds5_output_set_player_leds(struct ds5_output *out, unsigned char leds);
+int ds5_output_take(struct ds5_output *out, unsigned long long now,
+		    struct ds5_output_state *state);
+
+/* Nothing pending, see ds5_output_due() */
+#define DS5_OUTPUT_IDLE 0xFFFFFFFF
+
+unsigned int ds5_output_due(const struct ds5_output *out, unsigned long long now);
+
+#endif
@@ -0,0 +1,41 @@
+#include "predict.h"
+#include "report.h"
+
+static const int rest[DS5_AXIS_COUNT] = { 128, 128, 128, 128, 0, 0 };
+
+unsigned int ds5_predict(const unsigned char *prev2, const unsigned char *prev,
+			 const unsigned char *cur, unsigned int interval, unsigned int ahead,
+			 unsigned char *out)
+{
+	unsigned int axis, changed = 0;
+
+	if (interval < DS5_PREDICT_MIN_INTERVAL || interval > DS5_PREDICT_MAX_INTERVAL)
+		return 0;
+
+	for (axis = 0; axis < DS5_AXIS_COUNT; axis++) {
+		int delta = cur[axis] - prev[axis];
+		int before = prev[axis] - prev2[axis];
+		int from_rest = cur[axis] - rest[axis];
+		int value;
+
+		if (delta == 0 || from_rest == 0 || delta * before < 0)
+			continue;
+
+		value = cur[axis] + delta * (int)ahead / (int)interval;
+
+		/* Moving back to rest stops there, and sticks do not cross it */
+		if ((value - rest[axis]) * from_rest < 0)
+			value = rest[axis];
+		if (value < 0)
+			value = 0;
+		else if (value > 255)
+			value = 255;
+
+		if (value != cur[axis]) {
+			out[axis] = value;
+			changed |= 1 << axis;
+		}
+	}
+
+	return changed;
+}
@@ -0,0 +1,23 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+/* Longest extrapolation the config accepts, ms */
+#define DS5_PREDICT_MAX_AHEAD 16
+
+/* Report intervals outside this range say nothing about the motion, us */
+#define DS5_PREDICT_MIN_INTERVAL 1000
+#define DS5_PREDICT_MAX_INTERVAL 12000
+
+/*
+ * Extrapolates the six axes of the newest sample (struct ds5_state axes, in
+ * enum ds5_axis order) ahead us past its arrival, at the velocity since
+ * the previous sample, interval us before it. An axis is left alone if it
+ * is at rest or turned around since the sample before that, and never
+ * overshoots its range or its rest value. Writes the axes that changed to
+ * out and returns a mask of them, in DS5_MOVED_* bits.
+ */
+unsigned int ds5_predict(const unsigned char *prev2, const unsigned char *prev,
+			 const unsigned char *cur, unsigned int interval, unsigned int ahead,
+			 unsigned char *out);
+
+#endif
@@ -0,0 +1,384 @@
+#include <string.h>
+#include <psp2kern/ctrl.h>
+#include "report.h"
+#include "crc32.h"
+
+/* See struct ds5_input_report */
+const struct ds5_layout ds5_layout_0x11 = {
+	.report_id = 0x11,
+	.length = sizeof(struct ds5_input_report),
+	.crc = 0,
+	.sticks = 1,
+	.buttons = 5,
+	.triggers = 8,
+	.accel = 13,
+	.gyro = { 23, 21, 19 },
+	.battery = 30,
+	.plugged_mask = 0x01,
+	.finger = 35,
+	.seq = 7,
+	.seq_shift = 2,
+	.seq_mask = 0x3F,
+};
+
+/* DualSense native Bluetooth report, a 2 byte header before the USB layout */
+const struct ds5_layout ds5_layout_0x31 = {
+	.report_id = 0x31,
+	.length = DS5_0x31_REPORT_SIZE,
+	.crc = 1,
+	.sticks = 2 + 0,
+	.buttons = 2 + 7,
+	.triggers = 2 + 4,
+	.accel = 2 + 21,
+	.gyro = { 2 + 15, 2 + 17, 2 + 19 },
+	.battery = 2 + 52,
+	.plugged_mask = 0x0F,
+	.finger = 2 + 32,
+	.seq = 2 + 6,
+	.seq_shift = 0,
+	.seq_mask = 0xFF,
+};
+
+#define UP    SCE_CTRL_UP
+#define RIGHT SCE_CTRL_RIGHT
+#define DOWN  SCE_CTRL_DOWN
+#define LEFT  SCE_CTRL_LEFT
+
+/*
+ * The decode tables below hold the default mapping, ds5_report_set_remap()
+ * rebuilds them so a remap costs nothing per report.
+ */
+
+/* Hat switch, 0 = N going clockwise, 8 = released */
+static unsigned int dpad_table[16] = {
+	UP, UP | RIGHT, RIGHT, DOWN | RIGHT, DOWN, DOWN | LEFT, LEFT, UP | LEFT,
+};
+
+#define SQ SCE_CTRL_SQUARE
+#define CR SCE_CTRL_CROSS
+#define CI SCE_CTRL_CIRCLE
+#define TR SCE_CTRL_TRIANGLE
+
+static unsigned int face_table[16] = {
+	0,            SQ,           CR,           SQ | CR,
+	CI,           SQ | CI,      CR | CI,      SQ | CR | CI,
+	TR,           SQ | TR,      CR | TR,      SQ | CR | TR,
+	CI | TR,      SQ | CI | TR, CR | CI | TR, SQ | CR | CI | TR,
+};
+
+#define L1 SCE_CTRL_L1
+#define R1 SCE_CTRL_R1
+#define L2 SCE_CTRL_LTRIGGER
+#define R2 SCE_CTRL_RTRIGGER
+
+static unsigned int shoulder_table[16] = {
+	0,            L1,           R1,           L1 | R1,
+	L2,           L1 | L2,      R1 | L2,      L1 | R1 | L2,
+	R2,           L1 | R2,      R1 | R2,      L1 | R1 | R2,
+	L2 | R2,      L1 | L2 | R2, R1 | L2 | R2, L1 | R1 | L2 | R2,
+};
+
+#define SE SCE_CTRL_SELECT
+#define ST SCE_CTRL_START
+#define L3 SCE_CTRL_L3
+#define R3 SCE_CTRL_R3
+
+static unsigned int misc_table[16] = {
+	0,            SE,           ST,           SE | ST,
+	L3,           SE | L3,      ST | L3,      SE | ST | L3,
+	R3,           SE | R3,      ST | R3,      SE | ST | R3,
+	L3 | R3,      SE | L3 | R3, ST | L3 | R3, SE | ST | L3 | R3,
+};
+
+/* PS and touchpad click */
+static unsigned int ps_table[4] = {
+	0, SCE_CTRL_INTERCEPTED, 0, SCE_CTRL_INTERCEPTED,
+};
+
+/* Output axis to DS5 axis */
+static unsigned char axis_table[DS5_AXIS_COUNT] = {
+	DS5_AXIS_LX, DS5_AXIS_LY, DS5_AXIS_RX, DS5_AXIS_RY, DS5_AXIS_LT, DS5_AXIS_RT,
+};
+
+/* Raw value to output for each output axis, deadzones, curve and inversion baked in */
+static unsigned char axis_lut[DS5_AXIS_COUNT][256];
+
+/* Squared radial deadzone of the left and right sticks */
+static unsigned int radial_table[2];
+
+const struct ds5_remap ds5_remap_default = {
+	.button = {
+		SQ, CR, CI, TR, L1, R1, L2, R2, SE, ST, L3, R3,
+		SCE_CTRL_INTERCEPTED, 0, UP, RIGHT, DOWN, LEFT,
+	},
+	.axis = {
+		DS5_AXIS_LX, DS5_AXIS_LY, DS5_AXIS_RX, DS5_AXIS_RY, DS5_AXIS_LT, DS5_AXIS_RT,
+	},
+};
+
+/* ORs the mapping of each DS5 button set in bits, starting at first */
+static unsigned int remap_bits(const struct ds5_remap *remap, unsigned int bits,
+			       unsigned int first)
+{
+	unsigned int buttons = 0;
+	unsigned int i;
+
+	for (i = 0; bits; i++, bits >>= 1) {
+		if (bits & 1)
+			buttons |= remap->button[first + i];
+	}
+
+	return buttons;
+}
+
+/* Not synchronized with the decoder, call it once before the first report */
+void ds5_report_set_remap(const struct ds5_remap *remap, const struct ds5_analog *analog)
+{
+	/* Hat position to up/right/down/left bits */
+	static const unsigned char hat_dirs[8] = {
+		0x1, 0x3, 0x2, 0x6, 0x4, 0xC, 0x8, 0x9,
+	};
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) {
+		dpad_table[i] = i < 8 ? remap_bits(remap, hat_dirs[i], DS5_BTN_UP) : 0;
+		face_table[i] = remap_bits(remap, i, DS5_BTN_SQUARE);
+		shoulder_table[i] = remap_bits(remap, i, DS5_BTN_L1);
+		misc_table[i] = remap_bits(remap, i, DS5_BTN_SHARE);
+	}
+
+	for (i = 0; i < 4; i++)
+		ps_table[i] = remap_bits(remap, i, DS5_BTN_PS);
+
+	for (i = 0; i < DS5_AXIS_COUNT; i++) {
+		axis_table[i] = remap->axis[i] < DS5_AXIS_COUNT ? remap->axis[i] : i;
+		ds5_analog_build_lut(&analog->axis[i], i < DS5_AXIS_LT, remap->invert[i],
+			axis_lut[i]);
+	}
+
+	for (i = 0; i < 2; i++)
+		radial_table[i] = analog->radial[i] * analog->radial[i];
+}
+
+/* DS5_MOVED_LX..RY to byte masks over lx ly rx ry */
+static const unsigned int sticks_mask_table[16] = {
+	0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF,
+	0x00FF0000, 0x00FF00FF, 0x00FFFF00, 0x00FFFFFF,
+	0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF,
+	0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF,
+};
+
+/* DS5_MOVED_LT..RT to byte masks over lt rt */
+static const unsigned short triggers_mask_table[4] = {
+	0x0000, 0x00FF, 0xFF00, 0xFFFF,
+};
+
+/* The tables map the deadzones to exactly rest, so anything else moved */
+static inline unsigned int axis_moved(unsigned char v, unsigned int bit)
+{
+	return (v != 128) * bit;
+}
+
+/* Centers a stick inside its radial deadzone, with a mask rather than a branch */
+static inline void radial_deadzone(unsigned char *x, unsigned char *y, unsigned int r2)
+{
+	int dx = *x - 128;
+	int dy = *y - 128;
+	unsigned int mask = -(unsigned int)((unsigned int)(dx * dx + dy * dy) < r2);
+
+	*x = (*x & ~mask) | (128 & mask);
+	*y = (*y & ~mask) | (128 & mask);
+}
+
+static inline signed short read_s16(const unsigned char *p)
+{
+	return (signed short)(p[0] | (p[1] << 8));
+}
+
+static inline void decode_finger(const unsigned char *p, struct ds5_finger *finger)
+{
+	unsigned int w = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+
+	finger->id = w & 0x7F;
+	finger->active = !((w >> 7) & 1);
+	finger->x = (w >> 8) & 0xFFF;
+	finger->y = w >> 20;
+}
+
+static inline unsigned int trigger_moved(unsigned char v, unsigned int bit)
+{
+	return (v != 0) * bit;
+}
+
+void ds5_decode_report(const unsigned char *report, const struct ds5_layout *layout,
+		       struct ds5_state *state)
+{
+	const unsigned char *sticks = &report[layout->sticks];
+	const unsigned char *buttons = &report[layout->buttons];
+	const unsigned char *triggers = &report[layout->triggers];
+	const unsigned char *accel = &report[layout->accel];
+	unsigned char battery = report[layout->battery];
+	unsigned char axes[DS5_AXIS_COUNT] = {
+		sticks[0], sticks[1], sticks[2], sticks[3], triggers[0], triggers[1],
+	};
+	unsigned char lx, ly, rx, ry;
+
+	state->buttons = dpad_table[buttons[0] & 0x0F] |
+		face_table[buttons[0] >> 4] |
+		shoulder_table[buttons[1] & 0x0F] |
+		misc_table[buttons[1] >> 4] |
+		ps_table[buttons[2] & 3];
+
+	lx = axes[axis_table[DS5_AXIS_LX]];
+	ly = axes[axis_table[DS5_AXIS_LY]];
+	rx = axes[axis_table[DS5_AXIS_RX]];
+	ry = axes[axis_table[DS5_AXIS_RY]];
+
+	radial_deadzone(&lx, &ly, radial_table[0]);
+	radial_deadzone(&rx, &ry, radial_table[1]);
+
+	state->lx = axis_lut[DS5_AXIS_LX][lx];
+	state->ly = axis_lut[DS5_AXIS_LY][ly];
+	state->rx = axis_lut[DS5_AXIS_RX][rx];
+	state->ry = axis_lut[DS5_AXIS_RY][ry];
+	state->lt = axis_lut[DS5_AXIS_LT][axes[axis_table[DS5_AXIS_LT]]];
+	state->rt = axis_lut[DS5_AXIS_RT][axes[axis_table[DS5_AXIS_RT]]];
+
+	state->moved = axis_moved(state->lx, DS5_MOVED_LX) |
+		axis_moved(state->ly, DS5_MOVED_LY) |
+		axis_moved(state->rx, DS5_MOVED_RX) |
+		axis_moved(state->ry, DS5_MOVED_RY) |
+		trigger_moved(state->lt, DS5_MOVED_LT) |
+		trigger_moved(state->rt, DS5_MOVED_RT);
+
+	ds5_state_pack_analog(state);
+	state->sticks_mask = sticks_mask_table[state->moved & 0x0F];
+	state->triggers_mask = triggers_mask_table[state->moved >> 4];
+
+	state->battery_level = battery & 0x0F;
+	state->usb_plugged = ((battery >> 4) & layout->plugged_mask) != 0;
+
+	state->seq = (report[layout->seq] >> layout->seq_shift) & layout->seq_mask;
+
+	state->accel[0] = read_s16(&accel[0]);
+	state->accel[1] = read_s16(&accel[2]);
+	state->accel[2] = read_s16(&accel[4]);
+	state->gyro[0] = read_s16(&report[layout->gyro[0]]);
+	state->gyro[1] = read_s16(&report[layout->gyro[1]]);
+	state->gyro[2] = read_s16(&report[layout->gyro[2]]);
+
+	decode_finger(&report[layout->finger + 0], &state->finger[0]);
+	decode_finger(&report[layout->finger + 4], &state->finger[1]);
+}
+
+/* DS5_DIRTY_* of what differs between two decoded reports */
+unsigned int ds5_state_diff(const struct ds5_state *prev, const struct ds5_state *state)
+{
+	return (prev->buttons != state->buttons) * DS5_DIRTY_BUTTONS |
+		(prev->sticks != state->sticks ||
+		 prev->triggers != state->triggers) * DS5_DIRTY_ANALOG |
+		(memcmp(prev->finger, state->finger, sizeof(state->finger)) != 0) * DS5_DIRTY_TOUCH |
+		(memcmp(prev->accel, state->accel, sizeof(state->accel)) != 0 ||
+		 memcmp(prev->gyro, state->gyro, sizeof(state->gyro)) != 0) * DS5_DIRTY_MOTION |
+		(prev->battery_level != state->battery_level ||
+		 prev->usb_plugged != state->usb_plugged) * DS5_DIRTY_BATTERY;
+}
+
+/*
+ * The trailing CRC32 covers a 0xA1 (DATA | INPUT) byte followed by the
+ * whole report but the CRC itself.
+ */
+int ds5_report_crc_ok(const unsigned char *report, const struct ds5_layout *layout)
+{
+	static const unsigned char hdr = 0xA1;
+	unsigned int crc, expected;
+
+	if (!layout->crc)
+		return 1;
+
+	crc = crc32_update(0xFFFFFFFF, &hdr, 1);
+	crc = ~crc32_update(crc, report, layout->length - 4);
+
+	expected = report[layout->length - 4] |
+		(report[layout->length - 3] << 8) |
+		(report[layout->length - 2] << 16) |
+		((unsigned int)report[layout->length - 1] << 24);
+
+	return crc == expected;
+}
+
+/* Output reports are covered the same way, with a 0xA2 (DATA | OUTPUT) byte */
+void ds5_report_fill_crc(unsigned char *report, unsigned int length)
+{
+	static const unsigned char hdr = 0xA2;
+	unsigned int crc;
+
+	crc = crc32_update(0xFFFFFFFF, &hdr, 1);
+	crc = ~crc32_update(crc, report, length - 4);
+
+	report[length - 4] = crc;
+	report[length - 3] = crc >> 8;
+	report[length - 2] = crc >> 16;
+	report[length - 1] = crc >> 24;
+}
+
+/* Feature reports read back with a 0xA3 (DATA | FEATURE) byte */
+static int feature_crc_ok(const unsigned char *report, unsigned int length)
+{
+	static const unsigned char hdr = 0xA3;
+	unsigned int crc, expected;
+
+	crc = crc32_update(0xFFFFFFFF, &hdr, 1);
+	crc = ~crc32_update(crc, report, length - 4);
+
+	expected = report[length - 4] |
+		(report[length - 3] << 8) |
+		(report[length - 2] << 16) |
+		((unsigned int)report[length - 1] << 24);
+
+	return crc == expected;
+}
+
+/*
+ * Feature report 0x05: gyro bias, the raw gyro readings at +-speed deg/s
+ * and the raw accel readings at +-1 g, per axis. The DS4 sends its gyro
+ * plus readings before the minus ones over Bluetooth, the DualSense pairs
+ * them. Axes with a nonsense range keep the nominal values.
+ */
+int ds5_report_parse_calib(const unsigned char *report, unsigned int length, int native,
+			   struct ds5_motion_calib *calib)
+{
+	int speed_2x, i;
+
+	if (length < DS5_CALIB_REPORT_SIZE || report[0] != DS5_CALIB_REPORT_ID ||
+	    !feature_crc_ok(report, DS5_CALIB_REPORT_SIZE))
+		return -1;
+
+	ds5_motion_calib_default(calib);
+
+	speed_2x = read_s16(report + 19) + read_s16(report + 21);
+
+	for (i = 0; i < 3; i++) {
+		int plus = read_s16(report + (native ? 7 + 4 * i : 7 + 2 * i));
+		int minus = read_s16(report + (native ? 9 + 4 * i : 13 + 2 * i));
+		int scale;
+
+		calib->gyro_bias[i] = read_s16(report + 1 + 2 * i);
+
+		if (plus - minus > 0) {
+			scale = (long long)speed_2x * DS5_CALIB_RAD_PER_DEG / (plus - minus);
+			if (scale > DS5_MOTION_GYRO_SCALE / 2 && scale < DS5_MOTION_GYRO_SCALE * 2)
+				calib->gyro_scale[i] = scale;
+		}
+
+		plus = read_s16(report + 23 + 4 * i);
+		minus = read_s16(report + 25 + 4 * i);
+
+		if (plus - minus > DS5_MOTION_ACCEL_RES && plus - minus < DS5_MOTION_ACCEL_RES * 4) {
+			calib->accel_res[i] = (plus - minus) / 2;
+			calib->accel_bias[i] = plus - (plus - minus) / 2;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,227 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+#include "analog.h"
+#include "motion.h"
+#include "ds5vita.h"
+
+struct ds5_input_report {
+	unsigned char report_id;
+	unsigned char left_x;
+	unsigned char left_y;
+	unsigned char right_x;
+	unsigned char right_y;
+
+	unsigned char dpad     : 4;
+	unsigned char square   : 1;
+	unsigned char cross    : 1;
+	unsigned char circle   : 1;
+	unsigned char triangle : 1;
+
+	unsigned char l1      : 1;
+	unsigned char r1      : 1;
+	unsigned char l2      : 1;
+	unsigned char r2      : 1;
+	unsigned char share   : 1;
+	unsigned char options : 1;
+	unsigned char l3      : 1;
+	unsigned char r3      : 1;
+
+	unsigned char ps   : 1;
+	unsigned char tpad : 1;
+	unsigned char cnt1 : 6;
+
+	unsigned char l_trigger;
+	unsigned char r_trigger;
+
+	unsigned char cnt2;
+	unsigned char cnt3;
+
+	unsigned char battery;
+
+	signed short accel_x;
+	signed short accel_y;
+	signed short accel_z;
+
+	union {
+		signed short roll;
+		signed short gyro_z;
+	};
+	union {
+		signed short yaw;
+		signed short gyro_y;
+	};
+	union {
+		signed short pitch;
+		signed short gyro_x;
+	};
+
+	unsigned char unk1[5];
+
+	unsigned char battery_level : 4;
+	unsigned char usb_plugged   : 1;
+	unsigned char headphones    : 1;
+	unsigned char microphone    : 1;
+	unsigned char padding       : 1;
+
+	unsigned char unk2[2];
+	unsigned char trackpadpackets;
+	unsigned char packetcnt;
+
+	unsigned int finger1_id        : 7;
+	unsigned int finger1_activelow : 1;
+	unsigned int finger1_x         : 12;
+	unsigned int finger1_y         : 12;
+
+	unsigned int finger2_id        : 7;
+	unsigned int finger2_activelow : 1;
+	unsigned int finger2_x         : 12;
+	unsigned int finger2_y         : 12;
+
+} __attribute__((packed, aligned(32)));
+
+/* Analog axes that are out of their deadzone */
+#define DS5_MOVED_LX  (1 << 0)
+#define DS5_MOVED_LY  (1 << 1)
+#define DS5_MOVED_RX  (1 << 2)
+#define DS5_MOVED_RY  (1 << 3)
+#define DS5_MOVED_LT  (1 << 4)
+#define DS5_MOVED_RT  (1 << 5)
+
+/* Subsystems that changed since the previous report */
+#define DS5_DIRTY_BUTTONS (1 << DS5VITA_SUBSYSTEM_BUTTONS)
+#define DS5_DIRTY_ANALOG  (1 << DS5VITA_SUBSYSTEM_ANALOG)
+#define DS5_DIRTY_TOUCH   (1 << DS5VITA_SUBSYSTEM_TOUCH)
+#define DS5_DIRTY_MOTION  (1 << DS5VITA_SUBSYSTEM_MOTION)
+#define DS5_DIRTY_BATTERY (1 << DS5VITA_SUBSYSTEM_BATTERY)
+#define DS5_DIRTY_ALL     ((1 << DS5VITA_SUBSYSTEM_MAX) - 1)
+
+struct ds5_finger {
+	unsigned char id;
+	unsigned char active;
+	unsigned short x;
+	unsigned short y;
+};
+
+enum ds5_axis {
+	DS5_AXIS_LX,
+	DS5_AXIS_LY,
+	DS5_AXIS_RX,
+	DS5_AXIS_RY,
+	DS5_AXIS_LT,
+	DS5_AXIS_RT,
+	DS5_AXIS_COUNT
+};
+
+/* Decoded controller state, ready to be handed to SceCtrl/SceTouch/SceMotion */
+struct ds5_state {
+	unsigned int buttons;
+	union {
+		struct {
+			unsigned char lx;
+			unsigned char ly;
+			unsigned char rx;
+			unsigned char ry;
+			unsigned char lt;
+			unsigned char rt;
+		};
+		unsigned char axes[DS5_AXIS_COUNT]; /* in enum ds5_axis order */
+	};
+	unsigned char moved;
+
+	/*
+	 * lx ly rx ry and lt rt packed as in SceCtrlData, with 0xFF byte masks
+	 * over the moved axes, so they can be merged with a bitwise select.
+	 */
+	unsigned int sticks;
+	unsigned int sticks_mask;
+	unsigned short triggers;
+	unsigned short triggers_mask;
+
+	unsigned char battery_level;
+	unsigned char usb_plugged;
+	unsigned char seq;
+
+	signed short accel[3];
+	signed short gyro[3];
+
+	struct ds5_finger finger[2];
+};
+
+/* DS5 buttons, in the bit order of the report nibbles they come from */
+enum ds5_button {
+	DS5_BTN_SQUARE,
+	DS5_BTN_CROSS,
+	DS5_BTN_CIRCLE,
+	DS5_BTN_TRIANGLE,
+	DS5_BTN_L1,
+	DS5_BTN_R1,
+	DS5_BTN_L2,
+	DS5_BTN_R2,
+	DS5_BTN_SHARE,
+	DS5_BTN_OPTIONS,
+	DS5_BTN_L3,
+	DS5_BTN_R3,
+	DS5_BTN_PS,
+	DS5_BTN_TPAD,
+	DS5_BTN_UP,
+	DS5_BTN_RIGHT,
+	DS5_BTN_DOWN,
+	DS5_BTN_LEFT,
+	DS5_BTN_COUNT
+};
+
+struct ds5_remap {
+	unsigned int button[DS5_BTN_COUNT]; /* SceCtrl buttons each DS5 button presses */
+	unsigned char axis[DS5_AXIS_COUNT];  /* DS5 axis each output axis reads */
+	unsigned char invert[DS5_AXIS_COUNT];
+};
+
+/* Where the fields live in a given input report, all byte offsets */
+struct ds5_layout {
+	unsigned char report_id;
+	unsigned char length;       /* including the CRC, if any */
+	unsigned char crc;          /* the last 4 bytes are a CRC32 */
+	unsigned char sticks;       /* lx ly rx ry */
+	unsigned char buttons;      /* dpad|face, l1 r1 l2 r2|share options l3 r3, ps */
+	unsigned char triggers;     /* lt rt */
+	unsigned char accel;        /* x y z */
+	unsigned char gyro[3];      /* x, y, z */
+	unsigned char battery;      /* level in the low nibble, power state in the high one */
+	unsigned char plugged_mask; /* power state bits that mean external power */
+	unsigned char finger;       /* two 32-bit id:7 inactive:1 x:12 y:12 words */
+	unsigned char seq;          /* report counter, incremented by one per report */
+	unsigned char seq_shift;
+	unsigned char seq_mask;     /* counter modulo - 1 */
+};
+
+/* Repacks sticks and triggers after lx..rt were changed, the masks stay */
+static inline void ds5_state_pack_analog(struct ds5_state *state)
+{
+	state->sticks = state->lx | (state->ly << 8) |
+		(state->rx << 16) | ((unsigned int)state->ry << 24);
+	state->triggers = state->lt | (state->rt << 8);
+}
+
+#define DS5_0x31_REPORT_SIZE 78
+
+/* Motion sensor calibration, a feature report read once on connect */
+#define DS5_CALIB_REPORT_ID 0x05
+#define DS5_CALIB_REPORT_SIZE 41 /* including the CRC */
+#define DS5_CALIB_RAD_PER_DEG 74961321 /* pi / 180 in Q32 */
+
+extern const struct ds5_layout ds5_layout_0x11;
+extern const struct ds5_layout ds5_layout_0x31;
+extern const struct ds5_remap ds5_remap_default;
+
+void ds5_report_set_remap(const struct ds5_remap *remap, const struct ds5_analog *analog);
+
+void ds5_decode_report(const unsigned char *report, const struct ds5_layout *layout,
+		       struct ds5_state *state);
+unsigned int ds5_state_diff(const struct ds5_state *prev, const struct ds5_state *state);
+int ds5_report_crc_ok(const unsigned char *report, const struct ds5_layout *layout);
+void ds5_report_fill_crc(unsigned char *report, unsigned int length);
+int ds5_report_parse_calib(const unsigned char *report, unsigned int length, int native,
+			   struct ds5_motion_calib *calib);
+
+#endif
@@ -0,0 +1,48 @@
+#include <psp2kern/kernel/sysmem.h>
+#include "reqpool.h"
+
+int ds5_req_pool_init(struct ds5_req_pool *pool, SceUID heap_uid)
+{
+	pool->slots = ksceKernelAllocHeapMemory(heap_uid,
+		DS5_REQ_POOL_SIZE * sizeof(*pool->slots));
+	if (!pool->slots)
+		return -1;
+
+	pool->free_mask = (DS5_REQ_POOL_SIZE == 32) ? ~0U : (1U << DS5_REQ_POOL_SIZE) - 1;
+	pool->acquired = 0;
+	pool->exhausted = 0;
+
+	return 0;
+}
+
+void ds5_req_pool_fini(struct ds5_req_pool *pool, SceUID heap_uid)
+{
+	if (pool->slots) {
+		ksceKernelFreeHeapMemory(heap_uid, pool->slots);
+		pool->slots = NULL;
+	}
+	pool->free_mask = 0;
+}
+
+struct ds5_req_slot *ds5_req_pool_acquire(struct ds5_req_pool *pool)
+{
+	unsigned int mask, bit;
+
+	do {
+		mask = pool->free_mask;
+		if (!mask) {
+			__sync_fetch_and_add(&pool->exhausted, 1);
+			return NULL;
+		}
+		bit = mask & -mask;
+	} while (!__sync_bool_compare_and_swap(&pool->free_mask, mask, mask & ~bit));
+
+	__sync_fetch_and_add(&pool->acquired, 1);
+
+	return &pool->slots[__builtin_ctz(bit)];
+}
+
+void ds5_req_pool_release(struct ds5_req_pool *pool, struct ds5_req_slot *slot)
+{
+	__sync_fetch_and_or(&pool->free_mask, 1U << (slot - pool->slots));
+}
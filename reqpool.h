@@ -0,0 +1,30 @@
+#ifndef REQPOOL_H
+#define REQPOOL_H
+
+#include <psp2kern/bt.h>
+
+#define DS5_REQ_POOL_SIZE   8   /* at most 32, one bit per slot */
+#define DS5_REQ_PAYLOAD_MAX 0x80
+
+struct ds5_req_slot {
+	SceBtHidRequest req;
+	unsigned char buf[DS5_REQ_PAYLOAD_MAX];
+};
+
+/*
+ * Fixed-capacity slab of BT HID requests and their payloads, carved out
+ * of the heap once, so the send path never calls the allocator.
+ */
+struct ds5_req_pool {
+	struct ds5_req_slot *slots;
+	volatile unsigned int free_mask; /* bit n set = slots[n] is free */
+	volatile unsigned int acquired;
+	volatile unsigned int exhausted;
+};
+
+int ds5_req_pool_init(struct ds5_req_pool *pool, SceUID heap_uid);
+void ds5_req_pool_fini(struct ds5_req_pool *pool, SceUID heap_uid);
+struct ds5_req_slot *ds5_req_pool_acquire(struct ds5_req_pool *pool);
+void ds5_req_pool_release(struct ds5_req_pool *pool, struct ds5_req_slot *slot);
+
+#endif
@@ -0,0 +1,68 @@
+#include <string.h>
+#include "state.h"
+
+/* dmb on ARMv7 SMP, keeps the payload copies inside the seq updates */
+#define barrier() __sync_synchronize()
+
+void ds5_history_push(struct ds5_history *history, unsigned long long timestamp,
+		      const struct ds5_state *state)
+{
+	unsigned int index = history->head;
+	struct ds5_history_entry *entry = &history->entry[index & (DS5_HISTORY_SIZE - 1)];
+
+	/* An odd sequence tells the readers a write is in progress */
+	entry->seq++;
+	barrier();
+
+	entry->index = index;
+	entry->sample.timestamp = timestamp;
+	memcpy(&entry->sample.state, state, sizeof(*state));
+
+	barrier();
+	entry->seq++;
+
+	barrier();
+	history->head = index + 1;
+}
+
+int ds5_history_get(const struct ds5_history *history, unsigned int index,
+		    struct ds5_sample *sample)
+{
+	const struct ds5_history_entry *entry = &history->entry[index & (DS5_HISTORY_SIZE - 1)];
+	unsigned int seq, entry_index;
+
+	if (history->head - index - 1 >= DS5_HISTORY_SIZE)
+		return -1;
+
+	do {
+		seq = entry->seq;
+		barrier();
+
+		entry_index = entry->index;
+		memcpy(sample, (const void *)&entry->sample, sizeof(*sample));
+
+		barrier();
+	} while ((seq & 1) || seq != entry->seq);
+
+	return entry_index == index ? 0 : -1;
+}
+
+int ds5_history_latest(const struct ds5_history *history, struct ds5_state *state)
+{
+	struct ds5_sample sample;
+	int ret;
+
+	/* Only fails if the writer lapped the whole ring meanwhile */
+	do {
+		unsigned int head = ds5_history_head(history);
+
+		if (head == 0)
+			return -1;
+
+		ret = ds5_history_get(history, head - 1, &sample);
+	} while (ret < 0);
+
+	memcpy(state, &sample.state, sizeof(*state));
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include "report.h"
+
+#define DS5_HISTORY_SIZE 64 /* must be a power of 2 */
+
+struct ds5_sample {
+	unsigned long long timestamp; /* arrival time, ksceKernelGetSystemTimeWide() */
+	struct ds5_state state;
+};
+
+struct ds5_history_entry {
+	volatile unsigned int seq;
+	unsigned int index;
+	struct ds5_sample sample;
+};
+
+/*
+ * Single-writer/multi-reader ring of the most recent decoded reports.
+ * The BT callback appends with ds5_history_push(), the hooks take
+ * consistent copies with ds5_history_get() without ever blocking: each
+ * entry is guarded by its own sequence counter, and a sample that was
+ * overwritten while being read is reported as gone.
+ */
+struct ds5_history {
+	volatile unsigned int head;
+	struct ds5_history_entry entry[DS5_HISTORY_SIZE];
+};
+
+void ds5_history_push(struct ds5_history *history, unsigned long long timestamp,
+		      const struct ds5_state *state);
+
+/* Index one past the newest sample */
+static inline unsigned int ds5_history_head(const struct ds5_history *history)
+{
+	return history->head;
+}
+
+int ds5_history_get(const struct ds5_history *history, unsigned int index,
+		    struct ds5_sample *sample);
+int ds5_history_latest(const struct ds5_history *history, struct ds5_state *state);
+
+#endif
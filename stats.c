@@ -0,0 +1,64 @@
+#include <string.h>
+#include "stats.h"
+
+static struct ds5vita_latency_stats stats;
+
+static inline unsigned int bucket_of(unsigned int us)
+{
+	unsigned int b = us ? 32 - __builtin_clz(us) : 0;
+
+	return b < DS5VITA_HIST_BUCKETS ? b : DS5VITA_HIST_BUCKETS - 1;
+}
+
+static inline void update_max(unsigned int *max, unsigned int value)
+{
+	unsigned int old;
+
+	do {
+		old = *(volatile unsigned int *)max;
+		if (value <= old)
+			return;
+	} while (!__sync_bool_compare_and_swap(max, old, value));
+}
+
+static void histogram_add(struct ds5vita_histogram *h, unsigned int us)
+{
+	__sync_fetch_and_add(&h->bucket[bucket_of(us)], 1);
+	__sync_fetch_and_add(&h->count, 1);
+	__sync_fetch_and_add(&h->sum, us);
+	update_max(&h->max, us);
+}
+
+void ds5_stats_stage(enum ds5vita_stage stage, unsigned int us)
+{
+	histogram_add(&stats.stage[stage], us);
+}
+
+void ds5_stats_hook(enum ds5vita_hook hook, unsigned int us)
+{
+	struct ds5vita_hook_stats *h = &stats.hook[hook];
+
+	__sync_fetch_and_add(&h->calls, 1);
+	__sync_fetch_and_add(&h->time, us);
+	update_max(&h->max, us);
+}
+
+int ds5_stats_deliver(volatile unsigned int *delivered, unsigned int index, unsigned int us)
+{
+	unsigned int old;
+
+	do {
+		old = *delivered;
+		if ((int)(index + 1 - old) <= 0)
+			return 0;
+	} while (!__sync_bool_compare_and_swap(delivered, old, index + 1));
+
+	histogram_add(&stats.stage[DS5VITA_STAGE_DELIVER], us);
+	return 1;
+}
+
+/* Not a consistent cut, each counter is read on its own */
+void ds5_stats_get(struct ds5vita_latency_stats *out)
+{
+	memcpy(out, (const void *)&stats, sizeof(*out));
+}
@@ -0,0 +1,22 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "ds5vita.h"
+
+/*
+ * Lock-free latency accounting, every counter is updated with a single
+ * atomic operation so the hooks can record from any thread.
+ */
+
+void ds5_stats_stage(enum ds5vita_stage stage, unsigned int us);
+void ds5_stats_hook(enum ds5vita_hook hook, unsigned int us);
+
+/*
+ * Counts a delivery once per history index, returns 1 if it was the first.
+ * delivered is one past the newest index already accounted for.
+ */
+int ds5_stats_deliver(volatile unsigned int *delivered, unsigned int index, unsigned int us);
+
+void ds5_stats_get(struct ds5vita_latency_stats *stats);
+
+#endif
@@ -0,0 +1,131 @@
+#include <string.h>
+#include "touch.h"
+
+/* dmb on ARMv7 SMP, keeps the payload copies inside the seq updates */
+#define barrier() __sync_synchronize()
+
+const struct ds5_touch_zone ds5_touch_zones_front[1] = {
+	{ 0, 0, DS5_TOUCHPAD_W, DS5_TOUCHPAD_H, SCE_TOUCH_PORT_FRONT,
+	  0, 0, VITA_FRONT_TOUCHSCREEN_W, VITA_FRONT_TOUCHSCREEN_H },
+};
+
+const struct ds5_touch_zone ds5_touch_zones_split[2] = {
+	{ 0, 0, DS5_TOUCHPAD_W / 2, DS5_TOUCHPAD_H, SCE_TOUCH_PORT_FRONT,
+	  0, 0, VITA_FRONT_TOUCHSCREEN_W, VITA_FRONT_TOUCHSCREEN_H },
+	{ DS5_TOUCHPAD_W / 2, 0, DS5_TOUCHPAD_W, DS5_TOUCHPAD_H, SCE_TOUCH_PORT_BACK,
+	  0, VITA_BACK_TOUCHPAD_Y0, VITA_BACK_TOUCHPAD_W, VITA_BACK_TOUCHPAD_Y1 },
+};
+
+int ds5_touch_map_init(struct ds5_touch_map *map, const struct ds5_touch_zone *zones,
+		       unsigned int num_zones)
+{
+	unsigned int i;
+
+	if (num_zones > DS5_TOUCH_MAX_ZONES)
+		return -1;
+
+	for (i = 0; i < num_zones; i++) {
+		const struct ds5_touch_zone *z = &zones[i];
+
+		if (z->x1 <= z->x0 || z->y1 <= z->y0 || z->dx1 <= z->dx0 ||
+		    z->dy1 <= z->dy0 || z->port >= DS5_TOUCH_PORTS)
+			return -1;
+
+		map->zone[i].zone = *z;
+		map->zone[i].mul_x = ((z->dx1 - z->dx0) << 16) / (z->x1 - z->x0);
+		map->zone[i].mul_y = ((z->dy1 - z->dy0) << 16) / (z->y1 - z->y0);
+	}
+
+	map->num_zones = num_zones;
+	return 0;
+}
+
+void ds5_touch_init(struct ds5_touch *touch, const struct ds5_touch_map *map)
+{
+	memset(touch, 0, sizeof(*touch));
+	touch->map = map;
+	touch->zone[0] = touch->zone[1] = -1;
+}
+
+static int find_zone(const struct ds5_touch_map *map, unsigned int x, unsigned int y)
+{
+	unsigned int i;
+
+	for (i = 0; i < map->num_zones; i++) {
+		const struct ds5_touch_zone *z = &map->zone[i].zone;
+
+		if (x >= z->x0 && x < z->x1 && y >= z->y0 && y < z->y1)
+			return i;
+	}
+
+	return -1;
+}
+
+static inline unsigned int clamp(unsigned int v, unsigned int lo, unsigned int hi)
+{
+	return v < lo ? lo : (v >= hi ? hi - 1 : v);
+}
+
+/* Called by the BT thread for every report, the hooks only copy the frame */
+void ds5_touch_update(struct ds5_touch *touch, const struct ds5_finger finger[2])
+{
+	struct ds5_touch_frame *frame = &touch->frame;
+	const struct ds5_touch_map *map = touch->map;
+	int zone[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		const struct ds5_finger *f = &finger[i];
+
+		if (!f->active)
+			zone[i] = -1;
+		else if (f->id == touch->id[i] && touch->zone[i] >= 0)
+			zone[i] = touch->zone[i];
+		else
+			zone[i] = find_zone(map, f->x, f->y);
+	}
+
+	touch->seq++;
+	barrier();
+
+	frame->num[0] = frame->num[1] = 0;
+
+	for (i = 0; i < 2; i++) {
+		const struct ds5_finger *f = &finger[i];
+		const struct ds5_touch_zone *z;
+		SceTouchReport *r;
+		unsigned int x, y;
+
+		touch->id[i] = f->id;
+		touch->zone[i] = zone[i];
+		if (zone[i] < 0)
+			continue;
+
+		z = &map->zone[zone[i]].zone;
+		x = clamp(f->x, z->x0, z->x1) - z->x0;
+		y = clamp(f->y, z->y0, z->y1) - z->y0;
+
+		r = &frame->report[z->port][frame->num[z->port]++];
+		memset(r, 0, sizeof(*r));
+		r->id = f->id;
+		r->x = z->dx0 + ((x * map->zone[zone[i]].mul_x) >> 16);
+		r->y = z->dy0 + ((y * map->zone[zone[i]].mul_y) >> 16);
+	}
+
+	barrier();
+	touch->seq++;
+}
+
+void ds5_touch_read(const struct ds5_touch *touch, struct ds5_touch_frame *frame)
+{
+	unsigned int seq;
+
+	do {
+		seq = touch->seq;
+		barrier();
+
+		memcpy(frame, (const void *)&touch->frame, sizeof(*frame));
+
+		barrier();
+	} while ((seq & 1) || seq != touch->seq);
+}
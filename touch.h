@@ -0,0 +1,68 @@
+#ifndef TOUCH_H
+#define TOUCH_H
+
+#include <psp2/touch.h>
+#include "report.h"
+
+#define DS5_TOUCHPAD_W 1920
+#define DS5_TOUCHPAD_H 940
+
+#define VITA_FRONT_TOUCHSCREEN_W 1920
+#define VITA_FRONT_TOUCHSCREEN_H 1080
+
+/* The rear pad reports y from 108 down to 889 */
+#define VITA_BACK_TOUCHPAD_W  1920
+#define VITA_BACK_TOUCHPAD_Y0 108
+#define VITA_BACK_TOUCHPAD_Y1 890
+
+#define DS5_TOUCH_MAX_ZONES 4
+#define DS5_TOUCH_PORTS     2 /* SCE_TOUCH_PORT_FRONT, SCE_TOUCH_PORT_BACK */
+
+/* A rectangle of the DS5 touchpad and where it lands on a Vita panel */
+struct ds5_touch_zone {
+	unsigned short x0, y0, x1, y1;     /* source, end exclusive */
+	unsigned int port;
+	unsigned short dx0, dy0, dx1, dy1; /* destination, end exclusive */
+};
+
+/* Zones compiled at load, the scale factors are Q16 */
+struct ds5_touch_map {
+	unsigned int num_zones;
+	struct {
+		struct ds5_touch_zone zone;
+		unsigned int mul_x;
+		unsigned int mul_y;
+	} zone[DS5_TOUCH_MAX_ZONES];
+};
+
+/* Ready to copy reports for each panel */
+struct ds5_touch_frame {
+	unsigned int num[DS5_TOUCH_PORTS];
+	SceTouchReport report[DS5_TOUCH_PORTS][2];
+};
+
+/*
+ * Per controller mapping state. A finger stays in the zone it touched
+ * down in for as long as its id lasts, so it never jumps panels.
+ */
+struct ds5_touch {
+	const struct ds5_touch_map *map;
+	unsigned char id[2];
+	signed char zone[2];
+
+	volatile unsigned int seq;
+	struct ds5_touch_frame frame;
+};
+
+/* The whole pad on the front screen, and left half front / right half rear */
+extern const struct ds5_touch_zone ds5_touch_zones_front[1];
+extern const struct ds5_touch_zone ds5_touch_zones_split[2];
+
+int ds5_touch_map_init(struct ds5_touch_map *map, const struct ds5_touch_zone *zones,
+		       unsigned int num_zones);
+
+void ds5_touch_init(struct ds5_touch *touch, const struct ds5_touch_map *map);
+void ds5_touch_update(struct ds5_touch *touch, const struct ds5_finger finger[2]);
+void ds5_touch_read(const struct ds5_touch *touch, struct ds5_touch_frame *frame);
+
+#endif